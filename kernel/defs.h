@@ -8,8 +8,12 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
+struct shm;
+struct vma;
 struct pipe;
 struct proc;
+struct rusage;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -30,6 +34,9 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execproc(struct proc*, char*, char**);
+int             execfault(struct proc*, uint64, int, int);
+void            textfree(struct inode*);
 
 // file.c
 struct file*    filealloc(void);
@@ -69,6 +76,20 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kallocstat(void);
+void            kmemcount(uint64*, uint64*);
+void*           kalloc_zeroed(void);
+void            kzero_idle(void);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void            pageRef(void*);
+int             pageRefCount(void*);
+
+// slab.c
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void            slabstat(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -76,7 +97,36 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+uint64          mmap(uint64, int, int, struct file*, uint);
+int             munmap(uint64, uint64);
+void            munmapall(struct proc*);
+int             mmapcopy(struct proc*, struct proc*);
+uint64          mmapbase(struct proc*);
+char*           sharedpage(struct inode*, uint);
+void            sharedtrunc(struct inode*);
+void            sharedfree(struct inode*);
+struct vma*     vmaalloc(struct proc*, uint64);
+int             vmafault(struct proc*, uint64, int);
+
+// shm.c
+void            shminit(void);
+int             shmget(int, uint64);
+uint64          shmat(int);
+int             shmdt(uint64);
+int             shmrm(int);
+void            shmdup(struct shm*);
+void            shmput(struct shm*);
+
+// swap.c
+void            swapinit(void);
+int             swapout(int);
+int             swapin(struct proc*, uint64, int);
+void            swapdup(pte_t);
+void            swapfree(pte_t);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -91,6 +141,7 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             spawn(char*, char**, struct file**);
 int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
@@ -107,7 +158,7 @@ void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
-int             waitx(uint64 addr,int* rtime, int* wtime);
+int             waitx(uint64 addr,int* rtime, int* wtime, uint* lathist);
 void            wakeup(void*);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
@@ -116,6 +167,9 @@ void            procdump(void);
 int             set_priority(int, int);
 void            update_time(void);
 int             settickets(int);
+int             mlfqtick(struct proc*);
+int             cfstick(struct proc*);
+void            mlfqage(void);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -175,14 +229,25 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64, int);
 void            uvmfree(pagetable_t, uint64);
-void            uvmunmap(pagetable_t, uint64, uint64, int);
-void            uvmclear(pagetable_t, uint64);
+int             uvmunmap(pagetable_t, uint64, uint64, int);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walklevel(pagetable_t, uint64, int, int*);
+pte_t *         walkmega(pagetable_t, uint64, int);
+uint64          asidget(struct proc*);
+void            uvmflush(struct proc*);
+void            uvmflushpage(struct proc*, uint64);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
+int             cowfault(pagetable_t, uint64);
+int             lazyfault(pagetable_t, uint64, uint64, int);
+int             mapzero(pagetable_t, uint64, int);
+int             uvmfault(struct proc*, uint64, int, int, int);
+void            uvmprefault(uint64, uint64, int);
+void            uvmusage(struct proc*, struct rusage*);
 
 // plic.c
 void            plicinit(void);
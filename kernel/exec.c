@@ -5,10 +5,75 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 #include "elf.h"
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
 
+// Read-only program pages are cached per inode in ip->text,
+// a page of physical addresses indexed by file page number,
+// and mapped by every process running that inode. The cache
+// holds one reference to each page and each mapping another.
+#define NTEXT (PGSIZE / sizeof(uint64))
+
+// The file page holding s's page at va if it can be shared,
+// or -1 if the page is writable or not entirely from the file.
+static int
+textpgno(struct execseg *s, uint64 va)
+{
+  uint64 pn;
+
+  if((s->perm & PTE_W) || s->off % PGSIZE != 0)
+    return -1;
+  if(va + PGSIZE > s->va + s->filesz)
+    return -1;
+  pn = (s->off + (va - s->va)) / PGSIZE;
+  if(pn >= NTEXT)
+    return -1;
+  return pn;
+}
+
+// Return file page pn of ip with a reference for the caller,
+// reading it into the cache if needed. Caller holds ip->lock.
+static char *
+textget(struct inode *ip, int pn)
+{
+  char *mem;
+
+  if(ip->text == 0 && (ip->text = kalloc_zeroed()) == 0)
+    return 0;
+  if((mem = (char*)ip->text[pn]) == 0){
+    if((mem = kalloc()) == 0)
+      return 0;
+    if(readi(ip, 0, (uint64)mem, pn * PGSIZE, PGSIZE) != PGSIZE){
+      kfree(mem);
+      return 0;
+    }
+    ip->text[pn] = (uint64)mem;
+  }
+  pageRef(mem);
+  return mem;
+}
+
+// Drop ip's cached program pages, because ip is being
+// written or freed. Processes that map them keep theirs.
+// Caller holds ip->lock or the last reference to ip.
+void
+textfree(struct inode *ip)
+{
+  int i;
+
+  if(ip->text == 0)
+    return;
+  for(i = 0; i < NTEXT; i++)
+    if(ip->text[i])
+      kfree((void*)ip->text[i]);
+  kfree(ip->text);
+  ip->text = 0;
+}
+
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -21,15 +86,24 @@ int flags2perm(int flags)
 
 int
 exec(char *path, char **argv)
+{
+  return execproc(myproc(), path, argv);
+}
+
+// Replace p's user image with the program at path, as
+// exec() does for the calling process. spawn() uses this
+// to load a new process that isn't running yet.
+int
+execproc(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *execip = 0, *oldexecip;
   struct proghdr ph;
+  struct execseg seg[NEXECSEG];
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
 
   begin_op();
 
@@ -61,6 +135,30 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
+    if(ph.vaddr + ph.memsz > TRAPFRAME)
+      goto bad;
+    if(nseg < NEXECSEG){
+      // Don't read the segment now; execfault() brings
+      // its pages in from ip as the program touches them.
+      seg[nseg].va = ph.vaddr;
+      seg[nseg].memsz = ph.memsz;
+      seg[nseg].filesz = ph.filesz;
+      seg[nseg].off = ph.off;
+      seg[nseg].perm = PTE_R | PTE_U | flags2perm(ph.flags);
+      if(ph.vaddr + ph.memsz > sz)
+        sz = ph.vaddr + ph.memsz;
+      // Pages another process already read in cost nothing to map.
+      for(uint64 a = ph.vaddr; ip->text && a < ph.vaddr + ph.memsz; a += PGSIZE){
+        int pn = textpgno(&seg[nseg], a);
+        if(pn < 0 || ip->text[pn] == 0)
+          continue;
+        if(mappages(pagetable, a, PGSIZE, ip->text[pn], seg[nseg].perm) != 0)
+          goto bad;
+        pageRef((void*)ip->text[pn]);
+      }
+      nseg++;
+      continue;
+    }
     uint64 sz1;
     if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
       goto bad;
@@ -68,22 +166,27 @@ exec(char *path, char **argv)
     if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
-  iunlockput(ip);
+  // Keep a reference to ip for execfault().
+  iunlock(ip);
   end_op();
+  execip = ip;
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
-  // Allocate two pages at the next page boundary.
-  // Make the first inaccessible as a stack guard.
-  // Use the second as the user stack.
+  // Reserve USTACKMAX pages of stack at the next page
+  // boundary, above a guard page that user code can't
+  // touch. Only the top page, for the arguments, is
+  // allocated now; lazyfault() supplies the others as
+  // the stack grows down.
   sz = PGROUNDUP(sz);
+  if(mapzero(pagetable, sz, PTE_R) != 0)
+    goto bad;
+  sz += PGSIZE;
   uint64 sz1;
-  if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE, PTE_W)) == 0)
+  if((sz1 = uvmalloc(pagetable, sz + (USTACKMAX-1)*PGSIZE, sz + USTACKMAX*PGSIZE, PTE_W)) == 0)
     goto bad;
   sz = sz1;
-  uvmclear(pagetable, sz-2*PGSIZE);
   sp = sz;
   stackbase = sp - PGSIZE;
 
@@ -121,12 +224,25 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  munmapall(p);
   oldpagetable = p->pagetable;
+  oldexecip = p->execip;
   p->pagetable = pagetable;
+  uvmflush(p);
   p->sz = sz;
+  p->ustacktop = sz;
+  p->ustacklow = sz - PGSIZE;
+  p->execip = execip;
+  p->nexecseg = nseg;
+  memmove(p->execseg, seg, sizeof(seg));
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexecip){
+    begin_op();
+    iput(oldexecip);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -137,9 +253,95 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(execip){
+    begin_op();
+    iput(execip);
+    end_op();
+  }
   return -1;
 }
 
+// Bring in the pages of p's executable around user address va,
+// a window of FAULTAROUND pages that are not mapped yet.
+// Pages wholly in the bss get the shared zero page, unless
+// write is set and the page is va's.
+// Reading the file may sleep, so if cansleep is 0 nothing is
+// read and the fault fails.
+// Returns 0 if va is now mapped, -1 on failure, and 1 if va
+// doesn't belong to a program segment.
+int
+execfault(struct proc *p, uint64 va, int write, int cansleep)
+{
+  struct execseg *s;
+  uint64 a, start, end;
+  pte_t *pte;
+  char *mem;
+  int pn, locked, r = -1;
+
+  for(s = p->execseg; s < &p->execseg[p->nexecseg]; s++)
+    if(va >= s->va && va < s->va + s->memsz)
+      break;
+  if(s == &p->execseg[p->nexecseg])
+    return 1;
+  if(!cansleep)
+    return -1;
+
+  // The window is aligned, so that sequential faults
+  // don't read overlapping ranges.
+  va = PGROUNDDOWN(va);
+  start = va - va % (FAULTAROUND * PGSIZE);
+  if(start < s->va)
+    start = s->va;
+  end = start + FAULTAROUND * PGSIZE;
+  if(end > PGROUNDUP(s->va + s->memsz))
+    end = PGROUNDUP(s->va + s->memsz);
+
+  // A read() of this very executable holds its lock already.
+  locked = holdingsleep(&p->execip->lock);
+  if(!locked)
+    ilock(p->execip);
+  for(a = start; a < end; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    // A paged-out page may have been written; swapin() has it.
+    if(pte && (*pte & (PTE_V | PTE_SWAP))){
+      if(a == va)
+        goto out;
+      continue;
+    }
+    if(a >= PGROUNDUP(s->va + s->filesz) && !(write && a == va)){
+      if(mapzero(p->pagetable, a, s->perm) != 0)
+        goto out;
+      if(a == va)
+        r = 0;
+      continue;
+    }
+    if((pn = textpgno(s, a)) >= 0){
+      if((mem = textget(p->execip, pn)) == 0)
+        goto out;
+    } else if((mem = kalloc_zeroed()) == 0){
+      goto out;
+    } else if(a < s->va + s->filesz){
+      uint n = s->va + s->filesz - a;
+      if(n > PGSIZE)
+        n = PGSIZE;
+      if(readi(p->execip, 0, (uint64)mem, s->off + (a - s->va), n) != n){
+        kfree(mem);
+        goto out;
+      }
+    }
+    if(mappages(p->pagetable, a, PGSIZE, (uint64)mem, s->perm) != 0){
+      kfree(mem);
+      goto out;
+    }
+    if(a == va)
+      r = 0;
+  }
+ out:
+  if(!locked)
+    iunlock(p->execip);
+  return r;
+}
+
 // Load a program segment into pagetable at virtual address va.
 // va must be page-aligned
 // and the pages from va to va+sz must already be mapped.
@@ -21,6 +21,7 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // itable list, protected by itable.lock
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -30,6 +31,8 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+  uint64 *text;       // cached program pages, see exec.c
+  uint64 *shared;     // cached MAP_SHARED pages, see mmap.c
 };
 
 // map major device number to device functions.
@@ -1,62 +1,257 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous runs of 2^order pages.
+//
+// Free memory is kept by a binary buddy allocator:
+// a free block of 2^k pages starts at a page frame
+// number that is a multiple of 2^k, and its buddy is
+// the block at pfn ^ (1 << k). Freeing a block merges
+// it with its buddy for as long as the buddy is free.
 
 #include "types.h"
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
 #include "riscv.h"
+#include "proc.h"
 #include "defs.h"
 
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
-uint64 addressMap[ (PHYSTOP)/PGSIZE ] = {0};
+
+#define NPAGES ( (PHYSTOP-KERNBASE)/PGSIZE )
+#define PA2PFN(pa) ( ( (uint64)(pa) - KERNBASE ) / PGSIZE )
+#define PFN2PA(pfn) ( KERNBASE + (uint64)(pfn) * PGSIZE )
+
+// Number of page tables (or kernel users) holding each
+// physical page, for copy-on-write fork. Updated only
+// with atomic (amoadd) instructions, so no lock is needed.
+int addressMap[ NPAGES ];
 
 struct run
 {
     // Pointer to the next 4K-Block
     struct run *next;
+    // Previous block, on the buddy free lists only
+    struct run *prev;
 };
 
 struct
 {
-    // Associating a lock to freelist
+    // Associating a lock to the buddy free lists
     struct spinlock lock;
-    // Pointer to Linked-List of 4k Pages
-    struct run *freelist;
+    // Circular lists of free blocks, one per order
+    struct run freelist[MAXORDER+1];
+    int nfree[MAXORDER+1];
+    // Pages handed to the allocator at boot
+    int npages;
+    // 1 + order of the free block starting at each page,
+    // or 0 if no free block starts there.
+    uchar freeorder[NPAGES];
 } kmem;
 
+// Each CPU keeps up to PCACHE_MAX free pages in cpu->freepages
+// so that kalloc()/kfree() normally don't touch kmem.lock.
+// Pages move between a CPU's cache and the buddy lists
+// PCACHE_BATCH at a time.
+#define PCACHE_MAX    64
+#define PCACHE_BATCH  32
+
+// Pages zeroed ahead of time by idle CPUs (see kzero_idle),
+// handed out by kalloc_zeroed(). Pool pages are allocated
+// pages with a reference count of 1.
+#define ZPOOL_MAX 256
 
-struct spinlock reff;
+struct
+{
+    struct spinlock lock;
+    struct run *list;
+    int n;
+    uint64 hits;        // kalloc_zeroed() served from the pool
+    uint64 misses;      // kalloc_zeroed() that had to clear a page
+} zpool;
+
+// Clear a page with 64-bit stores.
+static void
+zeropage(void *pa)
+{
+    uint64 *p = (uint64*)pa;
+
+    for( int i = 0; i < PGSIZE/sizeof(uint64); i += 4 )
+    {
+        p[i] = 0;
+        p[i+1] = 0;
+        p[i+2] = 0;
+        p[i+3] = 0;
+    }
+}
+
+// Take a page off the zeroed pool, or return 0.
+static struct run*
+zpool_take(void)
+{
+    struct run *r;
+
+    acquire(&zpool.lock);
+    if( (r = zpool.list) != 0 )
+    {
+        zpool.list = r->next;
+        zpool.n--;
+    }
+    release(&zpool.lock);
+
+    if(r)
+        r->next = 0;
+    return r;
+}
+
+static void
+list_push(struct run *head, struct run *r)
+{
+    r->next = head->next;
+    r->prev = head;
+    head->next->prev = r;
+    head->next = r;
+}
+
+static void
+list_remove(struct run *r)
+{
+    r->prev->next = r->next;
+    r->next->prev = r->prev;
+}
+
+// Take a block of 2^order pages off the free lists,
+// splitting a larger block if needed.
+// Caller must hold kmem.lock.
+static struct run*
+buddy_alloc(int order)
+{
+    struct run *r, *b;
+    int k;
+
+    for( k = order; k <= MAXORDER; k++ )
+        if( kmem.nfree[k] > 0 )
+            break;
+    if( k > MAXORDER )
+        return 0;
+
+    r = kmem.freelist[k].next;
+    list_remove(r);
+    kmem.nfree[k]--;
+    kmem.freeorder[ PA2PFN(r) ] = 0;
+
+    // Give back the upper half until the block is the right size.
+    while( k > order )
+    {
+        k--;
+        b = (struct run*)( (char*)r + ( (uint64)PGSIZE << k ) );
+        kmem.freeorder[ PA2PFN(b) ] = k + 1;
+        list_push(&kmem.freelist[k], b);
+        kmem.nfree[k]++;
+    }
+    return r;
+}
+
+// Return a block of 2^order pages to the free lists,
+// merging it with its buddies.
+// Caller must hold kmem.lock.
+static void
+buddy_free(void *pa, int order)
+{
+    uint64 pfn = PA2PFN(pa);
+
+    while( order < MAXORDER )
+    {
+        uint64 buddy = pfn ^ ( 1L << order );
+
+        if( buddy >= NPAGES || kmem.freeorder[buddy] != order + 1 )
+            break;
+        list_remove( (struct run*)PFN2PA(buddy) );
+        kmem.nfree[order]--;
+        kmem.freeorder[buddy] = 0;
+        if( buddy < pfn )
+            pfn = buddy;
+        order++;
+    }
+
+    kmem.freeorder[pfn] = order + 1;
+    list_push(&kmem.freelist[order], (struct run*)PFN2PA(pfn));
+    kmem.nfree[order]++;
+}
 
 void
 kinit()
 {
-    for( int i = 0; i < ((PHYSTOP)/(PGSIZE)); i++ )
-        addressMap[i] = 1;
-
     initlock(&kmem.lock, "kmem");
+    initlock(&zpool.lock, "zpool");
+    for( int k = 0; k <= MAXORDER; k++ )
+        kmem.freelist[k].next = kmem.freelist[k].prev = &kmem.freelist[k];
     freerange(end, (void*)PHYSTOP);
 }
 
+// Move up to PCACHE_BATCH pages from the buddy lists
+// into c's cache. Interrupts must be disabled.
+static void
+pcache_refill(struct cpu *c)
+{
+    struct run *r;
+
+    acquire(&kmem.lock);
+    while( c->nfreepages < PCACHE_BATCH && (r = buddy_alloc(0)) != 0 )
+    {
+        r->next = c->freepages;
+        c->freepages = r;
+        c->nfreepages++;
+    }
+    release(&kmem.lock);
+}
+
+// Hand PCACHE_BATCH pages from c's cache back
+// to the buddy lists. Interrupts must be disabled.
+static void
+pcache_drain(struct cpu *c)
+{
+    struct run *r;
+
+    c->kfree_drains++;
+    acquire(&kmem.lock);
+    for( int n = 0; n < PCACHE_BATCH && (r = c->freepages) != 0; n++ )
+    {
+        c->freepages = r->next;
+        c->nfreepages--;
+        buddy_free(r, 0);
+    }
+    release(&kmem.lock);
+}
+
+// Hand [pa_start, pa_end) to the buddy allocator.
+// Only used when booting, before any CPU has a page cache.
 void
 freerange(void *pa_start, void *pa_end)
 {
     char *p;
     p = (char*)PGROUNDUP((uint64)pa_start);
+    acquire(&kmem.lock);
     for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
     {
-        kfree((void*)p);
+#ifdef KJUNK
+        // Fill with junk to catch dangling refs.
+        memset(p, 1, PGSIZE);
+#endif
+        buddy_free(p, 0);
+        kmem.npages++;
     }
+    release(&kmem.lock);
 }
 
 // Free the page of physical memory pointed at by pa,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc(). The page only goes back on a free list once its
+// last reference is dropped.
 void
 kfree(void *pa)
 {
@@ -67,76 +262,278 @@ kfree(void *pa)
         panic("kfree");
     }
 
-    int index = PGROUNDDOWN((uint64)pa) - KERNBASE;
-    index = index / PGSIZE;
-    acquire(&reff);
-    if ( index < 0 || index > 32*1024 )
+    int *ref = &addressMap[ PA2PFN(pa) ];
+    int n = __sync_sub_and_fetch(ref, 1);
+
+    if( n < 0 )
     {
-        release(&reff);
+        __sync_fetch_and_add(ref, 1);
+        printf("Invalid Page Free Request.\n");
         return;
     }
 
-    if( addressMap[index] <= 0 )
+    if ( n == 0 )
     {
-        printf("Invalid Page Free Request.\n");
-        release(&reff);
+#ifdef KJUNK
+        // Fill with junk to catch dangling refs.
+        memset(pa, 1, PGSIZE);
+#endif
+
+        r = (struct run*)pa;
+
+        push_off();
+        struct cpu *c = mycpu();
+        r->next = c->freepages;
+        c->freepages = r;
+        if( ++c->nfreepages >= PCACHE_MAX )
+            pcache_drain(c);
+        pop_off();
+    }
+}
+
+// Record one more page table mapping the page at pa.
+void
+pageRef( void* pa )
+{
+    if( (uint64)pa < KERNBASE || (uint64)pa >= PHYSTOP )
         return;
+    __sync_fetch_and_add(&addressMap[ PA2PFN(pa) ], 1);
+}
+
+// Number of references to the page at pa.
+int
+pageRefCount( void* pa )
+{
+    if( (uint64)pa < KERNBASE || (uint64)pa >= PHYSTOP )
+        return 0;
+    return __atomic_load_n(&addressMap[ PA2PFN(pa) ], __ATOMIC_ACQUIRE);
+}
+
+// Take a free page, or return 0.
+static void *
+kalloc_page(void)
+{
+    struct run *r;
+    struct cpu *c;
+
+    push_off();
+    c = mycpu();
+    if( c->nfreepages > 0 )
+    {
+        c->kalloc_hits++;
     }
     else
     {
-        addressMap[index]--;
+        c->kalloc_misses++;
+        pcache_refill(c);
     }
 
-    if ( addressMap[index] == 0 ) 
+    r = c->freepages;
+    if(r)
     {
-        // Fill with junk to catch dangling refs.
-        memset(pa, 1, PGSIZE);
-
-        r = (struct run*)pa;
+        c->freepages = r->next;
+        c->nfreepages--;
+    }
+    pop_off();
 
-        acquire(&kmem.lock);
-        r->next = kmem.freelist;
-        kmem.freelist = r;
-        release(&kmem.lock);
+    if(r)
+    {
+#ifdef KJUNK
+        memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+        // A page on a free list has no other users,
+        // so its reference count can be set directly.
+        addressMap[ PA2PFN(r) ] = 1;
+    }
+    else
+    {
+        // Out of free pages; fall back on the zeroed pool.
+        r = zpool_take();
     }
-    release(&reff);
+    return (void*)r;
 }
 
-void pageRef( void* page )
+// Allocate one 4096-byte page of physical memory.
+// If none is free and the caller may sleep, user
+// memory is paged out to make room (see swap.c).
+// Returns a pointer that the kernel can use.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc(void)
 {
-    int index = PGROUNDDOWN( (uint64)page - KERNBASE );
-    index = index / PGSIZE;
-    acquire(&reff);
-    if ( index < 0 || index >= 32*1024 )
+    void *pa;
+
+    while( (pa = kalloc_page()) == 0 && swapout(SWAPBATCH) > 0 )
+        ;
+    return pa;
+}
+
+// Allocate one page of physical memory filled with zeros,
+// preferably one that an idle CPU has already cleared.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+    struct run *r;
+
+    if( (r = zpool_take()) != 0 )
     {
-        release(&reff);
+        __sync_fetch_and_add(&zpool.hits, 1);
+        return (void*)r;
+    }
+
+    __sync_fetch_and_add(&zpool.misses, 1);
+    if( (r = kalloc()) != 0 )
+        zeropage(r);
+    return (void*)r;
+}
+
+// Called from an idle CPU's scheduler loop: clear one
+// free page and add it to the zeroed pool, unless the
+// pool is already full.
+void
+kzero_idle(void)
+{
+    struct run *r;
+
+    if( zpool.n >= ZPOOL_MAX )
+        return;
+    if( (r = kalloc()) == 0 )
         return;
+    zeropage(r);
+
+    acquire(&zpool.lock);
+    if( zpool.n < ZPOOL_MAX )
+    {
+        // The link word is cleared again by zpool_take().
+        r->next = zpool.list;
+        zpool.list = r;
+        zpool.n++;
+        r = 0;
     }
+    release(&zpool.lock);
 
-    addressMap[index]++;
-    release(&reff);
-    return ;
+    if(r)
+        kfree(r);
 }
 
+// Allocate 2^order physically contiguous pages,
+// aligned to their size. Returns 0 if no large enough
+// free block exists.
 void *
-kalloc(void)
+kalloc_pages(int order)
 {
     struct run *r;
 
+    if( order < 0 || order > MAXORDER )
+        return 0;
+    if( order == 0 )
+        return kalloc();
+
     acquire(&kmem.lock);
-    r = kmem.freelist;
-    
-    if(r)
-        kmem.freelist = r->next;
-    
+    r = buddy_alloc(order);
     release(&kmem.lock);
 
     if(r)
     {
-        memset((char*)r, 5, PGSIZE); // fill with junk
-        pageRef( (void*) r );
-        // Increasing the number of processes that are currently using this page.
+#ifdef KJUNK
+        memset((char*)r, 5, PGSIZE << order); // fill with junk
+#endif
+        for( int i = 0; i < (1 << order); i++ )
+            addressMap[ PA2PFN(r) + i ] = 1;
     }
     return (void*)r;
 }
 
+// Free a block returned by kalloc_pages(order).
+void
+kfree_pages(void *pa, int order)
+{
+    if( order == 0 )
+    {
+        kfree(pa);
+        return;
+    }
+    if( order < 0 || order > MAXORDER ||
+        ((uint64)pa % ((uint64)PGSIZE << order)) != 0 ||
+        (char*)pa < end || (uint64)pa >= PHYSTOP )
+    {
+        panic("kfree_pages");
+    }
+
+    for( int i = 0; i < (1 << order); i++ )
+        addressMap[ PA2PFN(pa) + i ] = 0;
+
+#ifdef KJUNK
+    // Fill with junk to catch dangling refs.
+    memset(pa, 1, PGSIZE << order);
+#endif
+
+    acquire(&kmem.lock);
+    buddy_free(pa, order);
+    release(&kmem.lock);
+}
+
+// Count the free pages, including those in the per-CPU
+// caches and the zeroed pool, and all the pages kalloc()
+// manages. A snapshot: the caches are read without locks.
+void
+kmemcount(uint64 *nfree, uint64 *ntotal)
+{
+    uint64 n = 0;
+
+    acquire(&kmem.lock);
+    for( int k = 0; k <= MAXORDER; k++ )
+        n += (uint64)kmem.nfree[k] << k;
+    *ntotal = kmem.npages;
+    release(&kmem.lock);
+
+    for( int i = 0; i < NCPU; i++ )
+        n += cpus[i].nfreepages;
+    *nfree = n + zpool.n;
+}
+
+// Print allocator statistics. For debugging.
+void
+kallocstat(void)
+{
+    int nfree[MAXORDER+1];
+    int total = 0, big = 0;
+
+    // Snapshot the buddy lists, then report how much
+    // of the free memory is too fragmented to back a
+    // 2 MiB superpage.
+    acquire(&kmem.lock);
+    for( int k = 0; k <= MAXORDER; k++ )
+    {
+        nfree[k] = kmem.nfree[k];
+        total += nfree[k] << k;
+        if( k >= SUPERPAGE_ORDER )
+            big += nfree[k] << k;
+    }
+    release(&kmem.lock);
+
+    printf("zpool: %d pages, kalloc_zeroed %d hit %d miss\n",
+           zpool.n, (int)zpool.hits, (int)zpool.misses);
+    printf("buddy: %d free pages, per order:", total);
+    for( int k = 0; k <= MAXORDER; k++ )
+        printf(" %d", nfree[k]);
+    printf("\n");
+    if( total > 0 )
+        printf("buddy: %d%% of free pages fragmented below order %d\n",
+               ( total - big ) * 100 / total, SUPERPAGE_ORDER);
+
+    for( int i = 0; i < NCPU; i++ )
+    {
+        struct cpu *c = &cpus[i];
+        uint64 total = c->kalloc_hits + c->kalloc_misses;
+
+        if( total == 0 )
+            continue;
+        printf("cpu %d: kalloc %d hit %d miss (%d%% hit), %d drains, %d cached\n",
+               i, (int)c->kalloc_hits, (int)c->kalloc_misses,
+               (int)( c->kalloc_hits * 100 / total ),
+               (int)c->kfree_drains, c->nfreepages);
+    }
+}
+
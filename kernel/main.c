@@ -5,7 +5,6 @@
 #include "defs.h"
 
 volatile static int started = 0;
-extern int total_tickets;
 
 // start() jumps here in supervisor mode on all CPUs.
 void
@@ -30,6 +29,9 @@ main()
         binit();         // buffer cache
         iinit();         // inode table
         fileinit();      // file table
+        pipeinit();      // pipe cache
+        shminit();       // shared-memory segments
+        swapinit();      // paging to disk
         virtio_disk_init(); // emulated hard disk
         userinit();      // first user process
         // Compiler tries to optimise code
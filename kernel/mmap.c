@@ -0,0 +1,367 @@
+//
+// File mappings: mmap() and munmap().
+//
+// A mapping is described by a struct vma in the process.
+// mmap() only records it; pages are read from the file on
+// first touch by vmafault(). MAP_PRIVATE pages are copies.
+// MAP_SHARED pages come from a per-inode cache, so every
+// mapping of a file page maps the same physical page, and
+// readi() and writei() use the cached pages too. Shared pages
+// that were written are written back to the file by munmap(),
+// exit() and exec(). Mappings are placed top-down below
+// TRAPFRAME, and the heap may not grow into them.
+//
+// Attached shared-memory segments (shm.c) are vmas too,
+// with no file.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+
+// Like program text (exec.c), MAP_SHARED pages are cached in
+// ip->shared, a page of physical addresses indexed by file
+// page number. The cache holds one reference to each page
+// and each mapping another. Pages stay cached until the inode
+// leaves the inode table; they are written back by their
+// mappings, so a cached page nobody maps is clean.
+#define NSHARED (PGSIZE / sizeof(uint64))
+
+// The cached page holding byte off of ip, or 0.
+// Caller holds ip->lock.
+char *
+sharedpage(struct inode *ip, uint off)
+{
+  if(ip->shared == 0 || off / PGSIZE >= NSHARED)
+    return 0;
+  return (char*)ip->shared[off / PGSIZE];
+}
+
+// Return file page pn of ip with a reference for the caller,
+// reading it into the cache if needed. Caller holds ip->lock.
+static char *
+sharedget(struct inode *ip, uint pn)
+{
+  char *mem;
+
+  if(ip->shared == 0 && (ip->shared = kalloc_zeroed()) == 0)
+    return 0;
+  if((mem = (char*)ip->shared[pn]) == 0){
+    if((mem = kalloc_zeroed()) == 0)
+      return 0;
+    // Past the end of the file, the page stays zero.
+    readi(ip, 0, (uint64)mem, pn * PGSIZE, PGSIZE);
+    ip->shared[pn] = (uint64)mem;
+  }
+  pageRef(mem);
+  return mem;
+}
+
+// Zero ip's cached pages, because ip has been truncated.
+// Caller holds ip->lock.
+void
+sharedtrunc(struct inode *ip)
+{
+  int i;
+
+  if(ip->shared == 0)
+    return;
+  for(i = 0; i < NSHARED; i++)
+    if(ip->shared[i])
+      memset((void*)ip->shared[i], 0, PGSIZE);
+}
+
+// Drop ip's cached pages, because ip is being freed.
+// Processes that map them keep theirs.
+void
+sharedfree(struct inode *ip)
+{
+  int i;
+
+  if(ip->shared == 0)
+    return;
+  for(i = 0; i < NSHARED; i++)
+    if(ip->shared[i])
+      kfree((void*)ip->shared[i]);
+  kfree(ip->shared);
+  ip->shared = 0;
+}
+
+// The lowest address used by p's mappings, or TRAPFRAME.
+uint64
+mmapbase(struct proc *p)
+{
+  uint64 base = TRAPFRAME;
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->addr && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+static struct vma *
+vmafind(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->addr && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// Find room for len bytes (a multiple of PGSIZE) in p's
+// address space and a free vma to describe it.
+// Returns the vma with only addr and len set, or 0.
+struct vma *
+vmaalloc(struct proc *p, uint64 len)
+{
+  struct vma *v, *free = 0;
+  uint64 addr;
+  int i;
+
+  if(len == 0 || len > TRAPFRAME)
+    return 0;
+
+  // Take the highest gap below TRAPFRAME that fits.
+  addr = TRAPFRAME - len;
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->addr == 0){
+      free = v;
+      continue;
+    }
+    if(addr < v->addr + v->len && v->addr < addr + len){
+      if(v->addr < len)
+        return 0;
+      addr = v->addr - len;
+      i = -1;  // check against all of them again
+    }
+  }
+  if(free == 0 || addr < PGROUNDUP(p->sz))
+    return 0;
+
+  free->addr = addr;
+  free->len = len;
+  return free;
+}
+
+// Drop v's reference to its file or segment, and free v.
+static void
+vmaput(struct vma *v)
+{
+  if(v->f)
+    fileclose(v->f);
+  else
+    shmput(v->shm);
+  memset(v, 0, sizeof(*v));
+}
+
+// Map len bytes of f from offset off into the current process.
+// Returns the address chosen, or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  struct vma *v;
+
+  if(len == 0 || len > TRAPFRAME || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if((prot & (PROT_READ | PROT_WRITE)) == 0)
+    return -1;
+  // Pages are read from the file even if only written.
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  // Private copies may be written, but not the file itself.
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+  // Shared pages must fit in the cache.
+  if(flags == MAP_SHARED && off / PGSIZE + PGROUNDUP(len) / PGSIZE > NSHARED)
+    return -1;
+  if((v = vmaalloc(myproc(), PGROUNDUP(len))) == 0)
+    return -1;
+  v->prot = prot;
+  v->flags = flags;
+  v->f = filedup(f);
+  v->off = off;
+  return v->addr;
+}
+
+// Write the dirty pages of v in [va, va+len) back to its
+// file, one page per log transaction. The page is the cached
+// one, so this writes other mappings' changes too.
+static void
+vmawriteback(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  struct inode *ip;
+  uint64 a;
+  uint off, n;
+  pte_t *pte;
+
+  if(v->f == 0 || v->flags != MAP_SHARED || !(v->prot & PROT_WRITE))
+    return;
+  ip = v->f->ip;
+  for(a = va; a < va + len; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte == 0 || (*pte & (PTE_V | PTE_D)) != (PTE_V | PTE_D))
+      continue;
+    off = v->off + (a - v->addr);
+    begin_op();
+    ilock(ip);
+    // Don't grow the file with the zeroes past its end.
+    if(off < ip->size){
+      n = ip->size - off;
+      if(n > PGSIZE)
+        n = PGSIZE;
+      writei(ip, 0, PTE2PA(*pte), off, n);
+    }
+    iunlock(ip);
+    end_op();
+  }
+}
+
+// Unmap [addr, addr+len) of the current process, which
+// must be the start, the end or all of one mapping.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  if((v = vmafind(p, addr)) == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if(addr + len > v->addr + v->len)
+    return -1;
+  if(addr != v->addr && addr + len != v->addr + v->len)
+    return -1;
+
+  vmawriteback(p, v, addr, len);
+  uvmunmap(p->pagetable, addr, len / PGSIZE, 1);
+  uvmflush(p);
+
+  if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+  }
+  v->len -= len;
+  if(v->len == 0)
+    vmaput(v);
+  return 0;
+}
+
+// Unmap all of p's mappings, for exit() and exec().
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->addr == 0)
+      continue;
+    vmawriteback(p, v, v->addr, v->len);
+    uvmunmap(p->pagetable, v->addr, v->len / PGSIZE, 1);
+    vmaput(v);
+  }
+  uvmflush(p);
+}
+
+// Give the child np of fork() p's mappings. Pages p has
+// touched are shared: copy-on-write for MAP_PRIVATE, and
+// plainly for MAP_SHARED so both see the same data.
+// Returns 0, or -1 with nothing left mapped in np.
+int
+mmapcopy(struct proc *p, struct proc *np)
+{
+  int i;
+  struct vma *v;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->addr == 0)
+      continue;
+    if(uvmshare(p->pagetable, np->pagetable, v->addr, v->addr + v->len,
+                v->flags == MAP_PRIVATE) < 0){
+      while(--i >= 0){
+        v = &np->vma[i];
+        if(v->addr == 0)
+          continue;
+        uvmunmap(np->pagetable, v->addr, v->len / PGSIZE, 1);
+        vmaput(v);
+      }
+      return -1;
+    }
+    np->vma[i] = *v;
+    if(v->f)
+      filedup(v->f);
+    else
+      shmdup(v->shm);
+  }
+  return 0;
+}
+
+// Map the page of a mapping that holds user address va: the
+// cached page for MAP_SHARED, or a copy for MAP_PRIVATE.
+// Returns 0 if va is now mapped, -1 on failure (including
+// a write to a page that is only readable), and 1 if va
+// isn't in a mapping. If cansleep is 0 the file can't be
+// read and the fault fails.
+int
+vmafault(struct proc *p, uint64 va, int cansleep)
+{
+  struct vma *v;
+  struct inode *ip;
+  pte_t *pte;
+  char *mem;
+  uint off;
+  int perm, locked;
+
+  if((v = vmafind(p, va)) == 0)
+    return 1;
+  // Segments are mapped in full by shmat().
+  if(v->f == 0)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if((pte = walk(p->pagetable, va, 0)) != 0 && (*pte & PTE_V))
+    return -1;
+  if(!cansleep)
+    return -1;
+
+  ip = v->f->ip;
+  off = v->off + (va - v->addr);
+  locked = holdingsleep(&ip->lock);
+  if(!locked)
+    ilock(ip);
+  if(v->flags == MAP_SHARED)
+    mem = sharedget(ip, off / PGSIZE);
+  else if((mem = kalloc_zeroed()) != 0)
+    // Past the end of the file, the page stays zero.
+    readi(ip, 0, (uint64)mem, off, PGSIZE);
+  if(!locked)
+    iunlock(ip);
+  if(mem == 0)
+    return -1;
+
+  perm = PTE_U;
+  if(v->prot & PROT_READ)
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_R | PTE_W;
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
@@ -4,8 +4,7 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // active i-nodes exercised by usertests (iref)
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
@@ -14,5 +13,14 @@
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define MAXORDER     10    // largest kalloc_pages() block is 2^MAXORDER pages
+#define FAULTAROUND  8     // executable pages read in per exec page fault
+#define USTACKMAX    64    // max pages of user stack, faulted in as it grows
+#define NVMA         16    // mmap()ed regions per process
+#define NSHM         16    // shared-memory segments
+#define SHMMAXPAGES  64    // pages per shared-memory segment
+#define NSWAP        2048  // pages of swap space (mkfs reserves the blocks)
+#define SWAPBATCH    8     // pages paged out at a time when kalloc() runs dry
+#define NLATBUCKET   24    // waitx() latency histogram: bucket i is under 2^i us
 
 #endif
@@ -9,7 +9,79 @@
 
 
 #ifdef LBS
-int total_tickets = 0;
+// The tickets of each RUNNABLE process, in a Fenwick tree
+// indexed by proc[] slot, so a draw is O(log NPROC).
+// A process's lotweight is protected by lottery.lock.
+struct {
+    struct spinlock lock;
+    uint64 tree[NPROC + 1];     // 1-based
+    uint64 total;
+} lottery;
+
+#define LOTQUANTUM 1000000      // cycles, the timer interval in start.c
+#define LOTMAXCOMP 16           // Most a compensation can multiply tickets by
+#endif
+
+#ifdef PBS
+// RUNNABLE processes in a binary min-heap ordered by
+// dynamic priority, then times scheduled, then age, so the
+// next one to run is at the top. A RUNNABLE process's
+// running and sleeping times don't change, so its key is
+// computed once when it is queued; only set_priority()
+// moves a queued process. pbskey and heapidx are protected
+// by pbsheap.lock.
+struct {
+    struct spinlock lock;
+    struct proc *heap[NPROC];
+    int n;
+} pbsheap;
+#endif
+
+#ifdef CFS
+// RUNNABLE processes in an AVL tree ordered by vruntime, the
+// time they have run scaled down by their weight. The one
+// that has run least runs next. A queued process's tree
+// fields and cfsweight are protected by cfs.lock.
+struct {
+    struct spinlock lock;
+    struct proc *root;
+    struct proc *first;         // Leftmost, next to run
+    uint64 minvruntime;         // Of the last process picked; never decreases
+    uint64 load;                // Sum of the queued processes' weights
+} cfs;
+
+#define CFSTICK     1000000             // cycles, the timer interval in start.c
+#define CFSLATENCY  (6 * CFSTICK)       // Every RUNNABLE process runs once in this
+#define CFSMINGRAN  (CFSTICK / 2)       // Least a process runs before preemption
+#define CFSWAKEGRAN (CFSTICK / 2)       // How far behind another must be to preempt
+#define NICE0WEIGHT 1024
+
+// Weight of each nice level from -20 to 19; each level is
+// about 10% of CPU time away from the next.
+static const int cfsweights[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15,
+};
+#endif
+
+#ifdef MLFQ
+// One FIFO queue of RUNNABLE processes per level, and a
+// bitmap of the levels that aren't empty, so picking the
+// next process and the preemption check in the timer
+// interrupt are O(1). A queued process's queue, last_tick
+// and rqnext are protected by mlfq.lock.
+struct {
+    struct spinlock lock;
+    struct proc *head[NMLFQ];
+    struct proc *tail[NMLFQ];
+    int ready;                  // Bit q set if head[q] != 0
+} mlfq;
 #endif
 
 
@@ -25,8 +97,11 @@ struct spinlock pid_lock;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void startchild(struct proc *p, struct proc *np);
+static void setrunnable(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
+extern pagetable_t kernel_pagetable;
 
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
@@ -34,9 +109,9 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
+// Make the page-table pages for each process's kernel
+// stack, high in memory and followed by an invalid guard
+// page. The stacks themselves are allocated by kstackalloc().
 void
 proc_mapstacks(pagetable_t kpgtbl)
 {
@@ -44,13 +119,56 @@ proc_mapstacks(pagetable_t kpgtbl)
 
     for(p = proc; p < &proc[NPROC]; p++)
     {
-        char *pa = kalloc();
-        if(pa == 0)
+        if(walk(kpgtbl, KSTACK((int) (p - proc)), 1) == 0)
         {
-            panic("kalloc");
+            panic("proc_mapstacks");
         }
-        uint64 va = KSTACK((int) (p - proc));
-        kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
+    }
+}
+
+// Bumped each time kstackalloc() maps a stack.
+static int kstackgen;
+
+// Give p's slot a kernel stack the first time it is used.
+// The stack stays mapped for the later processes in the
+// slot, so there are only as many stacks as processes
+// that ever ran at once. Only this slot's PTE changes, so
+// no lock is needed, but a CPU may have cached the PTE
+// while it was invalid; kstacksync() flushes it before
+// any CPU runs on the stack. Returns 0, or -1.
+static int
+kstackalloc(struct proc *p)
+{
+    pte_t *pte = walk(kernel_pagetable, p->kstack, 0);
+    char *pa;
+
+    if(*pte & PTE_V)
+    {
+        return 0;
+    }
+    if((pa = kalloc()) == 0)
+    {
+        return -1;
+    }
+    *pte = PA2PTE(pa) | PTE_R | PTE_W | PTE_V;
+    __sync_fetch_and_add(&kstackgen, 1);
+    return 0;
+}
+
+// Flush this CPU's TLB if kernel stacks were mapped since
+// it last did, before it switches to a process whose stack
+// may be one of them. The caller holds that process's lock,
+// which kstackalloc()'s caller held too, so the new count
+// is seen.
+static void
+kstacksync(struct cpu *c)
+{
+    int gen = kstackgen;
+
+    if(c->kstackgen != gen)
+    {
+        sfence_vma();
+        c->kstackgen = gen;
     }
 }
 
@@ -62,6 +180,24 @@ procinit(void)
 
     initlock(&pid_lock, "nextpid");
     initlock(&wait_lock, "wait_lock");
+#ifdef RR
+    for(int i = 0; i < NCPU; i++)
+    {
+        initlock(&cpus[i].rqlock, "runq");
+    }
+#endif
+#ifdef MLFQ
+    initlock(&mlfq.lock, "mlfq");
+#endif
+#ifdef LBS
+    initlock(&lottery.lock, "lottery");
+#endif
+#ifdef PBS
+    initlock(&pbsheap.lock, "pbsheap");
+#endif
+#ifdef CFS
+    initlock(&cfs.lock, "cfs");
+#endif
     for(p = proc; p < &proc[NPROC]; p++)
     {
         initlock(&p->lock, "proc");
@@ -144,14 +280,16 @@ found:
     p->in_tick = ticks;
     p->run_time = 0;
 
-    // Allocate a trapframe page.
-    if((p->trapframe = (struct trapframe *)kalloc()) == 0)
+    if(kstackalloc(p) < 0)
     {
         freeproc(p);
         release(&p->lock);
         return 0;
     }
-    if((p->Sigtrapframe = (struct trapframe *)kalloc()) == 0)
+
+    // Allocate a trapframe page. The one sigalarm() saves
+    // the registers in is allocated by its first call.
+    if((p->trapframe = (struct trapframe *)kalloc()) == 0)
     {
         freeproc(p);
         release(&p->lock);
@@ -194,6 +332,11 @@ found:
     p->num_sched = 0;
     p->running = 0;
     p->sleeping = 0;
+    p->heapidx = -1;
+#endif
+
+#ifdef CFS
+    p->priority = 60;               // Default priority, nice 0
 #endif
 
 
@@ -220,8 +363,7 @@ freeproc(struct proc *p)
     }
     if(p->Sigtrapframe)
     {
-        kfree((void*)p->Sigtrapframe); 	Scheduler 	rtime 	wtime
-RR 	Round Robin 	20 	
+        kfree((void*)p->Sigtrapframe);
     }
     p->trapframe = 0;
     p->Sigtrapframe = 0;
@@ -232,6 +374,16 @@ RR 	Round Robin 	20
     }
     p->pagetable = 0;
     p->sz = 0;
+    // Stale TLB entries may carry the old ASIDs.
+    memset(p->asid, 0, sizeof(p->asid));
+    p->ustacktop = 0;
+    p->ustacklow = 0;
+    p->minflt = 0;
+    p->majflt = 0;
+    p->cowflt = 0;
+    p->execip = 0;
+    p->nexecseg = 0;
+    p->superpages = 0;
     p->pid = 0;
     p->parent = 0;
     p->name[0] = 0;
@@ -249,11 +401,12 @@ RR 	Round Robin 	20
     p->in_tick = 0;
     p->run_time = 0;
     p->end_tick = 0;
+    memset(p->lathist, 0, sizeof(p->lathist));
     p->priority = 0;
 
 #ifdef LBS
-    /* total_tickets -= p->tickets; */
     p->tickets = 0;
+    p->lotused = 0;
 #endif
 
 
@@ -350,25 +503,16 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
   p->in_tick = ticks;
   p->mask = 0;
   
-  #ifdef LBS
-  total_tickets += p->tickets;
-#endif
-
-#ifdef MLFQ
-  p->in_tick = ticks;
-  p->queue = 0;
-  p->last_tick = ticks;
-  p->numTicks = 0;
-#endif
-
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only reserves the address space; each page is
+// allocated and zeroed on first touch (see lazyfault).
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -378,11 +522,14 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n > mmapbase(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    // Fails if a megapage can't be split for lack of memory.
+    if((sz = uvmdealloc(p->pagetable, sz, sz + n)) == p->sz)
+      return -1;
+    uvmflush(p);
   }
   p->sz = sz;
   return 0;
@@ -407,11 +554,24 @@ fork(void)
     // Copy user memory from parent to child.
     if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0)
     {
+        uvmflush(p);
         freeproc(np);
         release(&np->lock);
         return -1;
     }
     np->sz = p->sz;
+    np->ustacktop = p->ustacktop;
+    np->ustacklow = p->ustacklow;
+
+    if(mmapcopy(p, np) < 0)
+    {
+        uvmflush(p);
+        freeproc(np);
+        release(&np->lock);
+        return -1;
+    }
+    // The parent's writable pages are now read-only.
+    uvmflush(p);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -434,6 +594,13 @@ fork(void)
         }
     }
     np->cwd = idup(p->cwd);
+    if(p->execip)
+    {
+        np->execip = idup(p->execip);
+    }
+    np->nexecseg = p->nexecseg;
+    np->superpages = p->superpages;
+    memmove(np->execseg, p->execseg, sizeof(p->execseg));
 
     safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -441,16 +608,86 @@ fork(void)
     
     release(&np->lock);
 
+    startchild(p, np);
+
+    return pid;
+}
+
+// Create a process running the program at path, like fork()
+// followed by exec() in the child, but without copying the
+// caller's memory. ofile is the child's table of open files;
+// spawn() takes over its references.
+// Returns the child's pid, or -1 if path can't be run.
+int
+spawn(char *path, char **argv, struct file **ofile)
+{
+    int i, argc;
+    struct proc *np;
+    struct proc *p = myproc();
+
+    if((np = allocproc()) == 0)
+    {
+        for(i = 0; i < NOFILE; i++)
+        {
+            if(ofile[i])
+            {
+                fileclose(ofile[i]);
+            }
+        }
+        return -1;
+    }
+
+    memset(np->trapframe, 0, sizeof(*np->trapframe));
+    for(i = 0; i < NOFILE; i++)
+    {
+        np->ofile[i] = ofile[i];
+    }
+    np->cwd = idup(p->cwd);
+    np->mask = p->mask;
+    np->superpages = p->superpages;
+
+    // Nothing else touches np until it is RUNNABLE,
+    // and loading the program may sleep.
+    release(&np->lock);
+
+    if((argc = execproc(np, path, argv)) < 0)
+    {
+        for(i = 0; i < NOFILE; i++)
+        {
+            if(np->ofile[i])
+            {
+                fileclose(np->ofile[i]);
+                np->ofile[i] = 0;
+            }
+        }
+        begin_op();
+        iput(np->cwd);
+        end_op();
+        np->cwd = 0;
+        acquire(&np->lock);
+        freeproc(np);
+        release(&np->lock);
+        return -1;
+    }
+    np->trapframe->a0 = argc;
+
+    startchild(p, np);
+
+    return np->pid;
+}
+
+// Make np, a new child of p, runnable.
+static void
+startchild(struct proc *p, struct proc *np)
+{
     acquire(&wait_lock);
     np->parent = p;
     release(&wait_lock);
 
     acquire(&np->lock);
-    np->state = RUNNABLE;
 #ifdef MLFQ
     np->queue = 0;
     np->numTicks = 0;
-    np->last_tick = ticks;
     np->in_tick = ticks;
 #ifdef YES
     printf("[%d] started process %d\n", ticks, np->pid);
@@ -460,12 +697,10 @@ fork(void)
     np->priority = p->priority;
 #ifdef LBS
     np->tickets = p->tickets;
-    total_tickets += np->tickets;
 #endif
 
+    setrunnable(np);
     release(&np->lock);
-
-    return pid;
 }
 
 // Pass p's abandoned children to init.
@@ -494,6 +729,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and drop mapped files.
+  munmapall(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -505,8 +743,11 @@ exit(int status)
 
   begin_op();
   iput(p->cwd);
+  if(p->execip)
+    iput(p->execip);
   end_op();
   p->cwd = 0;
+  p->execip = 0;
 
 #ifdef YES
             printf("[%d] exited process %d\n", ticks, p->pid);
@@ -541,6 +782,10 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // The copyout below runs with wait_lock held.
+  if(addr != 0)
+    uvmprefault(addr, sizeof(int), 1);
+
   acquire(&wait_lock);
 
   for(;;){
@@ -581,12 +826,18 @@ wait(uint64 addr)
   }
 }
 
-int waitx(uint64 addr, int *rtime, int *wtime)
+// Like wait(), and also return the child's run and wait
+// times in ticks, and in lathist, if not 0, how many times
+// it waited for a cpu for under 2^i microseconds.
+int waitx(uint64 addr, int *rtime, int *wtime, uint *lathist)
 {
     struct proc *np;
     int havekids, pid;
     struct proc *p = myproc();
 
+    if (addr != 0)
+        uvmprefault(addr, sizeof(int), 1);
+
     acquire(&wait_lock);
 
     for (;;)
@@ -607,6 +858,10 @@ int waitx(uint64 addr, int *rtime, int *wtime)
                     pid = np->pid;
                     *rtime = np->run_time;
                     *wtime = np->end_tick - np->in_tick - np->run_time;
+                    if (lathist != 0)
+                    {
+                        memmove(lathist, np->lathist, sizeof(np->lathist));
+                    }
                     if (addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate, sizeof(np->xstate)) < 0)
                     {
                         release(&np->lock);
@@ -695,124 +950,712 @@ rand(void)
 }
 
 
-// Per-CPU process scheduler.
-// Each CPU calls scheduler() after setting itself up.
-// Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
-//  - swtch to start running that process.
-//  - eventually that process transfers control
-//    via swtch back to the scheduler.
-void
-scheduler(void)
+#ifdef RR
+// Each cpu keeps the processes made runnable on it in a
+// FIFO run queue, so picking the next one is O(1) and
+// doesn't touch other processes' locks. A cpu whose queue
+// is empty steals from the longest one.
+
+// Append p to this cpu's run queue.
+// Caller must hold p->lock, so interrupts are off.
+static void
+runqput(struct proc *p)
 {
-    // Commented out below line becaus of warning:
-    // Unused variable "p"
-    // struct proc *p;
     struct cpu *c = mycpu();
 
-    c->proc = 0;
-    for(;;)
+    acquire(&c->rqlock);
+    p->rqnext = 0;
+    if(c->rqtail)
     {
-        // Avoid deadlock by ensuring that devices can interrupt.
-        intr_on();
+        c->rqtail->rqnext = p;
+    }
+    else
+    {
+        c->rqhead = p;
+    }
+    c->rqtail = p;
+    c->rqlen++;
+    release(&c->rqlock);
+}
 
+// Take the first process off c's run queue, or return 0.
+static struct proc*
+runqget(struct cpu *c)
+{
+    struct proc *p;
 
-#ifdef RR
-        for(struct proc* p = proc; p < &proc[NPROC]; p++)
+    // Unlocked peek, so idle cpus don't bounce the lock.
+    if(c->rqlen == 0)
+    {
+        return 0;
+    }
+    acquire(&c->rqlock);
+    if((p = c->rqhead) != 0)
+    {
+        c->rqhead = p->rqnext;
+        if(c->rqhead == 0)
         {
-            acquire(&p->lock);
-            if(p->state == RUNNABLE)
-            {
-                // Switch to chosen process.  It is the process's job
-                // to release its lock and then reacquire it
-                // before jumping back to us.
-                p->state = RUNNING;
-                c->proc = p;
-                swtch(&c->context, &p->context);
+            c->rqtail = 0;
+        }
+        c->rqlen--;
+    }
+    release(&c->rqlock);
+    return p;
+}
 
-                // Process is done running for now.
-                // It should have changed its p->state before coming back.
-                c->proc = 0;
-            }
-            release(&p->lock);
+// Take a process from the cpu, other than c, with the
+// longest run queue, or return 0 if they are all empty.
+static struct proc*
+runqsteal(struct cpu *c)
+{
+    struct cpu *victim = 0;
+    struct cpu *o;
+
+    for(o = cpus; o < &cpus[NCPU]; o++)
+    {
+        if(o != c && o->rqlen > 0 && (victim == 0 || o->rqlen > victim->rqlen))
+        {
+            victim = o;
         }
+    }
+    return victim ? runqget(victim) : 0;
+}
 #endif
 
+#ifdef MLFQ
+// Append p to the queue of its level.
+// Caller must hold mlfq.lock.
+static void
+mlfqappend(struct proc *p)
+{
+    int q = p->queue;
 
-#ifdef FCFS
-        struct proc* to_run = 0;
-        for (struct proc* p = proc; p < &proc[NPROC]; p++)
+    p->rqnext = 0;
+    p->last_tick = ticks;
+    if(mlfq.tail[q])
+    {
+        mlfq.tail[q]->rqnext = p;
+    }
+    else
+    {
+        mlfq.head[q] = p;
+    }
+    mlfq.tail[q] = p;
+    mlfq.ready |= 1 << q;
+}
+
+// Take the first process off queue q, which isn't empty.
+// Caller must hold mlfq.lock.
+static struct proc*
+mlfqpop(int q)
+{
+    struct proc *p = mlfq.head[q];
+
+    mlfq.head[q] = p->rqnext;
+    if(mlfq.head[q] == 0)
+    {
+        mlfq.tail[q] = 0;
+        mlfq.ready &= ~(1 << q);
+    }
+    return p;
+}
+
+// Queue p, first moving it down a level if it used up
+// its quantum. Caller must hold p->lock.
+static void
+mlfqput(struct proc *p)
+{
+    if(p->queue < NMLFQ - 1 && p->numTicks >= QUANTUM(p->queue))
+    {
+        p->queue++;
+#ifdef YES
+        printf("[%d] queue for %d changed from %d to %d\n", ticks, p->pid, p->queue - 1, p->queue);
+#endif
+    }
+    acquire(&mlfq.lock);
+    mlfqappend(p);
+    release(&mlfq.lock);
+}
+
+// Take the first process of the highest non-empty
+// level, or return 0.
+static struct proc*
+mlfqget(void)
+{
+    struct proc *p = 0;
+
+    if(mlfq.ready == 0)
+    {
+        return 0;
+    }
+    acquire(&mlfq.lock);
+    for(int q = 0; q < NMLFQ; q++)
+    {
+        if(mlfq.ready & (1 << q))
         {
-            // Hold the process so no other core can access it
-            acquire(&p->lock);
-            if (p->state == RUNNABLE)
-            {
-                if (to_run == 0)
-                {
-                    to_run = p;
-                    continue;
-                }
-                else if (p->in_tick < to_run->in_tick)
-                {
-                    // to_run is no longer useful so release it
-                    release(&to_run->lock);
-                    to_run = p;
-                    continue;
-                }
-            }
-            release(&p->lock);
+            p = mlfqpop(q);
+            break;
         }
-        if (to_run != 0)
+    }
+    release(&mlfq.lock);
+    return p;
+}
+
+// Charge a timer tick to the running process p.
+// Returns 1 if p should yield: it used up its quantum,
+// or a process is waiting at a higher level.
+int
+mlfqtick(struct proc *p)
+{
+    p->numTicks++;
+    return p->numTicks >= QUANTUM(p->queue) || (mlfq.ready & (QUANTUM(p->queue) - 1));
+}
+
+// Move processes that have waited MAXWAIT ticks in their
+// queue up a level. Each queue is in last_tick order, so
+// only the ones that move are looked at. Called from
+// clockintr().
+void
+mlfqage(void)
+{
+    struct proc *p;
+
+    acquire(&mlfq.lock);
+    for(int q = 1; q < NMLFQ; q++)
+    {
+        while((p = mlfq.head[q]) != 0 && ticks - p->last_tick >= MAXWAIT(q))
         {
-            to_run->state = RUNNING;
-            c->proc = to_run;
-            swtch(&c->context, &to_run->context);
-            c->proc = 0;
-            release(&to_run->lock);
+            mlfqpop(q);
+            p->queue--;
+#ifdef YES
+            printf("[%d] queue for %d changed from %d to %d\n", ticks, p->pid, q, q - 1);
+#endif
+            mlfqappend(p);
         }
+    }
+    release(&mlfq.lock);
+}
 #endif
 
+#ifdef LBS
+// Add n (mod 2^64) to the tickets of slot i.
+// Caller must hold lottery.lock.
+static void
+lotadd(int i, uint64 n)
+{
+    for(i++; i <= NPROC; i += i & -i)
+    {
+        lottery.tree[i] += n;
+    }
+    lottery.total += n;
+}
 
+// Enter p in the draw. A process that slept after using
+// only a fraction f of its quantum gets compensation: its
+// tickets count 1/f times until it next runs, so blocking
+// often doesn't cost it its share of the CPU.
+// Caller must hold p->lock.
+static void
+lotput(struct proc *p)
+{
+    uint64 w = p->tickets;
 
-#ifdef LBS
-        if (total_tickets < 0)
+    if(p->lotused > 0 && p->lotused < LOTQUANTUM)
+    {
+        if(p->lotused < LOTQUANTUM / LOTMAXCOMP)
         {
-            panic("Negative Tickets");
+            p->lotused = LOTQUANTUM / LOTMAXCOMP;
         }
-        struct proc* to_run = 0;
-        int x = rand() % total_tickets + 1;
-        int prefix = 0;
-        for (struct proc* p = proc; p < &proc[NPROC]; p++)
+        w = w * LOTQUANTUM / p->lotused;
+    }
+    p->lotused = 0;
+    acquire(&lottery.lock);
+    p->lotweight = w;
+    lotadd(p - proc, w);
+    release(&lottery.lock);
+}
+
+// Draw a winning ticket and take its owner out of the
+// draw, or return 0 if nothing is RUNNABLE.
+static struct proc*
+lotdraw(void)
+{
+    struct proc *p;
+    uint64 x;
+    int i, step;
+
+    if(lottery.total == 0)
+    {
+        return 0;
+    }
+    acquire(&lottery.lock);
+    if(lottery.total == 0)
+    {
+        release(&lottery.lock);
+        return 0;
+    }
+    x = (((uint64)rand() << 31) | rand()) % lottery.total;
+
+    // Descend the tree for the slot whose tickets cover x.
+    for(step = 1; step * 2 <= NPROC; step *= 2)
+        ;
+    for(i = 0; step > 0; step /= 2)
+    {
+        if(i + step <= NPROC && lottery.tree[i + step] <= x)
         {
-            acquire(&p->lock);
-            if (p->state == RUNNABLE)
-            {
-                if (x <= prefix + p->tickets)
-                {
-                    to_run = p;
-                    break;
-                }
-                prefix += p->tickets;
-            }
-            release(&p->lock);
+            i += step;
+            x -= lottery.tree[i];
         }
-        if (to_run != 0)
+    }
+    p = &proc[i];
+    lotadd(i, -p->lotweight);
+    p->lotweight = 0;
+    release(&lottery.lock);
+    return p;
+}
+#endif
+
+#ifdef PBS
+// Should a run before b?
+static int
+pbsless(struct proc *a, struct proc *b)
+{
+    if(a->pbskey != b->pbskey)
+    {
+        return a->pbskey < b->pbskey;
+    }
+    if(a->num_sched != b->num_sched)
+    {
+        return a->num_sched < b->num_sched;
+    }
+    return a->in_tick < b->in_tick;
+}
+
+static void
+pbsset(int i, struct proc *p)
+{
+    pbsheap.heap[i] = p;
+    p->heapidx = i;
+}
+
+// Move the process at i up or down to its place.
+// Caller must hold pbsheap.lock.
+static void
+pbsfix(int i)
+{
+    struct proc *p = pbsheap.heap[i];
+    int c;
+
+    while(i > 0 && pbsless(p, pbsheap.heap[(i - 1) / 2]))
+    {
+        pbsset(i, pbsheap.heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    while((c = 2 * i + 1) < pbsheap.n)
+    {
+        if(c + 1 < pbsheap.n && pbsless(pbsheap.heap[c + 1], pbsheap.heap[c]))
         {
-            total_tickets -= to_run->tickets;
-            to_run->state = RUNNING;
-            c->proc = to_run;
-            swtch(&c->context, &to_run->context);
-            c->proc = 0;
-            release(&to_run->lock);
+            c++;
+        }
+        if(!pbsless(pbsheap.heap[c], p))
+        {
+            break;
+        }
+        pbsset(i, pbsheap.heap[c]);
+        i = c;
+    }
+    pbsset(i, p);
+}
+
+// Add p to the heap. Caller must hold p->lock.
+static void
+pbsput(struct proc *p)
+{
+    acquire(&pbsheap.lock);
+    p->pbskey = nice_priority(p);
+    pbsset(pbsheap.n++, p);
+    pbsfix(p->heapidx);
+    release(&pbsheap.lock);
+}
+
+// Take the process that should run next off the heap,
+// or return 0 if it is empty.
+static struct proc*
+pbsget(void)
+{
+    struct proc *p;
+
+    if(pbsheap.n == 0)
+    {
+        return 0;
+    }
+    acquire(&pbsheap.lock);
+    if(pbsheap.n == 0)
+    {
+        release(&pbsheap.lock);
+        return 0;
+    }
+    p = pbsheap.heap[0];
+    p->heapidx = -1;
+    if(--pbsheap.n > 0)
+    {
+        pbsset(0, pbsheap.heap[pbsheap.n]);
+        pbsfix(0);
+    }
+    release(&pbsheap.lock);
+    return p;
+}
+
+// p's priority changed: move it in the heap if it is
+// queued. Caller must hold p->lock.
+static void
+pbsupdate(struct proc *p)
+{
+    acquire(&pbsheap.lock);
+    if(p->heapidx >= 0)
+    {
+        p->pbskey = nice_priority(p);
+        pbsfix(p->heapidx);
+    }
+    release(&pbsheap.lock);
+}
+#endif
+
+#ifdef CFS
+// p's weight, from its priority: 60 is nice 0, and every
+// 2 points is a nice level, lower being favoured.
+static uint64
+cfsweightof(struct proc *p)
+{
+    int nice = Max(-20, Min((p->priority - 60) / 2, 19));
+
+    return cfsweights[nice + 20];
+}
+
+// Charge the running process p for the time since it was
+// last charged.
+static void
+cfscharge(struct proc *p)
+{
+    uint64 now = r_time();
+
+    p->vruntime += (now - p->cfsstart) * NICE0WEIGHT / cfsweightof(p);
+    p->cfsstart = now;
+}
+
+static int
+cfsbefore(struct proc *a, struct proc *b)
+{
+    if(a->vruntime != b->vruntime)
+    {
+        return a->vruntime < b->vruntime;
+    }
+    return a < b;
+}
+
+static int
+cfsh(struct proc *t)
+{
+    return t ? t->cfsheight : 0;
+}
+
+static void
+cfsupdate(struct proc *t)
+{
+    t->cfsheight = Max(cfsh(t->cfsleft), cfsh(t->cfsright)) + 1;
+}
+
+static struct proc*
+cfsrotright(struct proc *t)
+{
+    struct proc *l = t->cfsleft;
+
+    t->cfsleft = l->cfsright;
+    l->cfsright = t;
+    cfsupdate(t);
+    cfsupdate(l);
+    return l;
+}
+
+static struct proc*
+cfsrotleft(struct proc *t)
+{
+    struct proc *r = t->cfsright;
+
+    t->cfsright = r->cfsleft;
+    r->cfsleft = t;
+    cfsupdate(t);
+    cfsupdate(r);
+    return r;
+}
+
+// Restore the AVL balance at t, whose subtrees are
+// balanced and differ in height by at most 2.
+static struct proc*
+cfsbalance(struct proc *t)
+{
+    int b = cfsh(t->cfsleft) - cfsh(t->cfsright);
+
+    if(b > 1)
+    {
+        if(cfsh(t->cfsleft->cfsleft) < cfsh(t->cfsleft->cfsright))
+        {
+            t->cfsleft = cfsrotleft(t->cfsleft);
+        }
+        return cfsrotright(t);
+    }
+    if(b < -1)
+    {
+        if(cfsh(t->cfsright->cfsright) < cfsh(t->cfsright->cfsleft))
+        {
+            t->cfsright = cfsrotright(t->cfsright);
+        }
+        return cfsrotleft(t);
+    }
+    cfsupdate(t);
+    return t;
+}
+
+// Insert p into the tree t and return its new root.
+static struct proc*
+cfsinsert(struct proc *t, struct proc *p)
+{
+    if(t == 0)
+    {
+        p->cfsleft = p->cfsright = 0;
+        p->cfsheight = 1;
+        return p;
+    }
+    if(cfsbefore(p, t))
+    {
+        t->cfsleft = cfsinsert(t->cfsleft, p);
+    }
+    else
+    {
+        t->cfsright = cfsinsert(t->cfsright, p);
+    }
+    return cfsbalance(t);
+}
+
+// Remove the leftmost process from t and return the new root.
+static struct proc*
+cfsremovefirst(struct proc *t)
+{
+    if(t->cfsleft == 0)
+    {
+        return t->cfsright;
+    }
+    t->cfsleft = cfsremovefirst(t->cfsleft);
+    return cfsbalance(t);
+}
+
+// Queue p, which was in state old. A yielding process is
+// charged first, as its vruntime is the key in the tree.
+// A new process starts level with the others. A sleeper
+// keeps at most half a period of credit, so it runs soon
+// after waking but can't save up CPU time by sleeping.
+// Caller must hold p->lock.
+static void
+cfsput(struct proc *p, enum procstate old)
+{
+    if(old == RUNNING)
+    {
+        cfscharge(p);
+    }
+    acquire(&cfs.lock);
+    if(old == USED)
+    {
+        p->vruntime = cfs.minvruntime;
+    }
+    else if(old == SLEEPING && p->vruntime + CFSLATENCY / 2 < cfs.minvruntime)
+    {
+        p->vruntime = cfs.minvruntime - CFSLATENCY / 2;
+    }
+    p->cfsweight = cfsweightof(p);
+    cfs.load += p->cfsweight;
+    cfs.root = cfsinsert(cfs.root, p);
+    if(cfs.first == 0 || cfsbefore(p, cfs.first))
+    {
+        cfs.first = p;
+    }
+    release(&cfs.lock);
+}
+
+// Take the process with the least vruntime out of the
+// tree, or return 0 if it is empty.
+static struct proc*
+cfsget(void)
+{
+    struct proc *p;
+
+    if(cfs.first == 0)
+    {
+        return 0;
+    }
+    acquire(&cfs.lock);
+    if((p = cfs.first) != 0)
+    {
+        cfs.root = cfsremovefirst(cfs.root);
+        for(cfs.first = cfs.root; cfs.first && cfs.first->cfsleft; cfs.first = cfs.first->cfsleft)
+            ;
+        cfs.load -= p->cfsweight;
+        if(p->vruntime > cfs.minvruntime)
+        {
+            cfs.minvruntime = p->vruntime;
         }
+    }
+    release(&cfs.lock);
+    return p;
+}
+
+// Charge the running process p on a timer tick. Returns 1
+// if p should yield: it has run for at least CFSMINGRAN and
+// either used up its share of CFSLATENCY or some queued
+// process is more than CFSWAKEGRAN behind it, as a process
+// that just woke usually is.
+int
+cfstick(struct proc *p)
+{
+    uint64 slice, w;
+    int preempt = 0;
+
+    cfscharge(p);
+    if(p->cfsstart - p->cfsdispatch < CFSMINGRAN)
+    {
+        return 0;
+    }
+    acquire(&cfs.lock);
+    if(cfs.first != 0)
+    {
+        w = cfsweightof(p);
+        slice = CFSLATENCY * w / (cfs.load + w);
+        if(slice < CFSMINGRAN)
+        {
+            slice = CFSMINGRAN;
+        }
+        preempt = p->cfsstart - p->cfsdispatch >= slice ||
+                  p->vruntime > cfs.first->vruntime + CFSWAKEGRAN;
+    }
+    release(&cfs.lock);
+    return preempt;
+}
 #endif
 
+// Count how long p, which has just been given a cpu,
+// waited since it became RUNNABLE. The time CSR runs at
+// 10 MHz on qemu, so it is divided by 10 for microseconds.
+// Caller must hold p->lock.
+static void
+latrecord(struct proc *p)
+{
+    uint64 us = (r_time() - p->readyat) / 10;
+    int i = 0;
+
+    while(i < NLATBUCKET - 1 && us >= (1L << i))
+    {
+        i++;
+    }
+    p->lathist[i]++;
+}
 
+// Mark p RUNNABLE and queue it for the scheduler.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+#ifdef CFS
+    enum procstate old = p->state;
+#endif
 
 #ifdef PBS
+    // Sleeping time is counted here, not on every tick.
+    if (p->state == SLEEPING)
+    {
+        p->sleeping += ticks - p->sleptat;
+    }
+#endif
+    p->state = RUNNABLE;
+    p->readyat = r_time();
+#ifdef RR
+    runqput(p);
+#endif
+#ifdef MLFQ
+    mlfqput(p);
+#endif
+#ifdef LBS
+    lotput(p);
+#endif
+#ifdef PBS
+    pbsput(p);
+#endif
+#ifdef CFS
+    cfsput(p, old);
+#endif
+}
+
+// Per-CPU process scheduler.
+// Each CPU calls scheduler() after setting itself up.
+// Scheduler never returns.  It loops, doing:
+//  - choose a process to run.
+//  - swtch to start running that process.
+//  - eventually that process transfers control
+//    via swtch back to the scheduler.
+void
+scheduler(void)
+{
+    // Commented out below line becaus of warning:
+    // Unused variable "p"
+    // struct proc *p;
+    struct cpu *c = mycpu();
+
+    c->proc = 0;
+    for(;;)
+    {
+        // Avoid deadlock by ensuring that devices can interrupt.
+        intr_on();
+
+        // Set once a process has been run in this pass.
+        int ran = 0;
+
+
+#ifdef RR
+        // Take the next process from this cpu's run queue,
+        // or from the busiest cpu's if ours is empty.
+        struct proc *p = runqget(c);
+        if(p == 0)
+        {
+            p = runqsteal(c);
+        }
+        if(p != 0)
+        {
+            // p's lock is still held by the cpu it yielded
+            // on until that cpu is off p's kernel stack.
+            acquire(&p->lock);
+            if(p->state == RUNNABLE)
+            {
+                // Switch to chosen process.  It is the process's job
+                // to release its lock and then reacquire it
+                // before jumping back to us.
+                p->state = RUNNING;
+                c->proc = p;
+                kstacksync(c);
+                swtch(&c->context, &p->context);
+                ran = 1;
+
+                // Process is done running for now.
+                // It should have changed its p->state before coming back.
+                c->proc = 0;
+            }
+            release(&p->lock);
+        }
+#endif
+
+
+#ifdef FCFS
         struct proc* to_run = 0;
         for (struct proc* p = proc; p < &proc[NPROC]; p++)
         {
+            // Hold the process so no other core can access it
             acquire(&p->lock);
             if (p->state == RUNNABLE)
             {
@@ -821,106 +1664,115 @@ scheduler(void)
                     to_run = p;
                     continue;
                 }
-                else if (nice_priority(to_run) > nice_priority(p))
+                else if (p->in_tick < to_run->in_tick)
                 {
-                    // "p" will be favoured in comparison to "to_run"
+                    // to_run is no longer useful so release it
                     release(&to_run->lock);
                     to_run = p;
                     continue;
                 }
-                else if (nice_priority(to_run) == nice_priority(p))
-                {
-                    // Compare according to number of times process is scheduled
-                    if (to_run->num_sched > p->num_sched)
-                    {
-                        // Choosing the process scheduled less number of times
-                        release(&to_run->lock);
-                        to_run = p;
-                        continue;
-                    }
-                    else if (to_run->num_sched == p->num_sched)
-                    {
-                        // FCFS
-                        if (to_run->in_tick < p->in_tick)
-                        {
-                            release(&to_run->lock);
-                            to_run = p;
-                            continue;
-                        }
-                    }
-                }
             }
             release(&p->lock);
         }
         if (to_run != 0)
         {
-            to_run->num_sched++;
-            to_run->running = 0;
-            to_run->sleeping = 0;
             to_run->state = RUNNING;
             c->proc = to_run;
+            kstacksync(c);
             swtch(&c->context, &to_run->context);
+            ran = 1;
             c->proc = 0;
             release(&to_run->lock);
         }
-
 #endif
 
-#ifdef MLFQ
 
-    struct proc *currProc = 0; 
-    // First find the current process to be used.
-    for ( struct proc *p = proc; p < &proc[NPROC]; p++ )
-    {  
-        acquire(&p->lock);
 
-        if ( p->state == RUNNABLE && currProc == 0 )
+#ifdef LBS
+        struct proc *p = lotdraw();
+        if(p != 0)
         {
-            currProc = p;
+            acquire(&p->lock);
+            if(p->state == RUNNABLE)
+            {
+                p->lotstart = r_time();
+                p->state = RUNNING;
+                c->proc = p;
+                kstacksync(c);
+                swtch(&c->context, &p->context);
+                ran = 1;
+                c->proc = 0;
+            }
+            release(&p->lock);
         }
-        else if ( p->state == RUNNABLE && p->queue <= currProc->queue)
+#endif
+
+
+
+#ifdef PBS
+        struct proc *p = pbsget();
+        if(p != 0)
         {
-            // The processes are in the same queue
-            // Now, we need to check which process is older
-            if ( p->queue < currProc->queue )
+            acquire(&p->lock);
+            if(p->state == RUNNABLE)
             {
-                release(&currProc->lock);
-                currProc = p;
+                p->num_sched++;
+                p->running = 0;
+                p->sleeping = 0;
+                p->state = RUNNING;
+                c->proc = p;
+                kstacksync(c);
+                swtch(&c->context, &p->context);
+                ran = 1;
+                c->proc = 0;
             }
-            else if ( p->in_tick < currProc->in_tick )
-            {
-                // The process p is older than currProc
-                // therefore should be executed now.
-                release(&currProc->lock);
-                currProc = p;
-            } 
-            else 
-                release(&p->lock);
-        } 
-        else 
             release(&p->lock);
-    }
-    
-    // At this point, currProc stores the 
-    // process that needs to be run.
-    
-    if(currProc != 0) 
-    {
-        if ( currProc->state == RUNNABLE )
+        }
+#endif
+
+#ifdef CFS
+        struct proc *p = cfsget();
+        if(p != 0)
         {
-            currProc->last_tick = ticks;
-            currProc->numTicks = 0;
-            // printf("Reached Here.\n");
-            currProc->state = RUNNING;
-            c->proc = currProc;
-            // printf("guchu guchu\n");
-            swtch(&c->context, &currProc->context);
-            c->proc = 0;
+            acquire(&p->lock);
+            if(p->state == RUNNABLE)
+            {
+                p->cfsdispatch = p->cfsstart = r_time();
+                p->state = RUNNING;
+                c->proc = p;
+                kstacksync(c);
+                swtch(&c->context, &p->context);
+                ran = 1;
+                c->proc = 0;
+            }
+            release(&p->lock);
         }
-        release(&currProc->lock);
-    }
+#endif
 
+#ifdef MLFQ
+        struct proc *p = mlfqget();
+        if(p != 0)
+        {
+            acquire(&p->lock);
+            if(p->state == RUNNABLE)
+            {
+                p->last_tick = ticks;
+                p->numTicks = 0;
+                p->state = RUNNING;
+                c->proc = p;
+                kstacksync(c);
+                swtch(&c->context, &p->context);
+                ran = 1;
+                c->proc = 0;
+            }
+            release(&p->lock);
+        }
 #endif
+
+        // Nothing to run: use the idle time to
+        // pre-zero a page for kalloc_zeroed().
+        if(!ran)
+            kzero_idle();
     }
 }
 
@@ -946,9 +1798,16 @@ sched(void)
   if(intr_get())
     panic("sched interruptible");
 
+#ifdef CFS
+  // yield() charged p before queueing it, and another cpu
+  // may already be reading its vruntime.
+  if(p->state != RUNNABLE)
+    cfscharge(p);
+#endif
   intena = mycpu()->intena;
   swtch(&p->context, &mycpu()->context);
   mycpu()->intena = intena;
+  latrecord(p);
 }
 
 // Give up the CPU for one scheduling round.
@@ -957,25 +1816,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
-
-#ifdef LBS
-  total_tickets += p->tickets;
-#endif
-
-#ifdef MLFQ
-    if ( p->queue < 4 && p->numTicks >= (1 << p->queue ) )
-    {
-        p->queue++;
-#ifdef YES
-        printf("[%d] queue for %d changed from %d to %d\n", ticks, p->pid, p->queue - 1, p->queue);
-#endif
-
-    }
-    p->last_tick = ticks;
-    p->numTicks = 0;
-#endif
-
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -988,6 +1829,7 @@ forkret(void)
   static int first = 1;
 
   // Still holding p->lock from scheduler.
+  latrecord(myproc());
   release(&myproc()->lock);
 
   if (first) {
@@ -1021,6 +1863,12 @@ sleep(void *chan, struct spinlock *lk)
   release(lk);
 
   // Go to sleep.
+#ifdef LBS
+  p->lotused = r_time() - p->lotstart;
+#endif
+#ifdef PBS
+  p->sleptat = ticks;
+#endif
   p->chan = chan;
   p->state = SLEEPING;
   sched();
@@ -1045,18 +1893,7 @@ wakeup(void *chan)
     if(p != myproc()){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-
-#ifdef LBS
-        total_tickets += p->tickets;
-#endif
-
-
-
-#ifdef MLFQ
-        p->last_tick = ticks;
-        p->numTicks = 0;
-#endif
+        setrunnable(p);
       }
       release(&p->lock);
     }
@@ -1077,10 +1914,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
-#ifdef LBS
-        total_tickets += p->tickets;
-#endif
+        setrunnable(p);
       }
       release(&p->lock);
       return 0;
@@ -1165,8 +1999,13 @@ procdump(void)
     else
       state = "???";
     printf("%d %s %s", p->pid, state, p->name);
+    // Peak user stack; initcode has none of its own.
+    if(p->ustacktop)
+      printf(" stack %dK", (int)(p->ustacktop - p->ustacklow) / 1024);
     printf("\n");
   }
+  kallocstat();
+  slabstat();
 }
 
 // Returns the old priority value
@@ -1197,16 +2036,24 @@ set_priority(int new_priority, int pid)
     if (flag)
     {
         printf("Priority of [%d] : %d -> %d\n", pid, old_priority, new_priority);
+#ifdef PBS
         if (new_priority < old_priority)
         {
             // req_proc will be prioritised more now
-#ifdef PBS
             req_proc->running = 0;
             req_proc->sleeping = 0;
-            yield();
-#endif
+            req_proc->sleptat = ticks;
         }
+        pbsupdate(req_proc);
+#endif
         release(&req_proc->lock);
+#ifdef PBS
+        // Not while holding req_proc->lock, which may be ours.
+        if (new_priority < old_priority)
+        {
+            yield();
+        }
+#endif
         return old_priority;
     }
     else
@@ -1217,27 +2064,21 @@ set_priority(int new_priority, int pid)
 }
 
 
-// Updates the attributes of proc data-structure for scheduling
+// Charge a clock tick to the process running on this CPU,
+// on every CPU's own timer interrupt. Only this CPU changes
+// the counts while p runs, so no lock is needed; waiting and
+// sleeping time come from timestamps instead.
 void
 update_time()
 {
-    for (struct proc* p = proc; p < &proc[NPROC]; p++)
+    struct proc *p = myproc();
+
+    if (p != 0 && p->state == RUNNING)
     {
-        acquire(&p->lock);
-        if (p->state == RUNNING)
-        {
-            p->run_time++;
+        p->run_time++;
 #ifdef PBS
-            p->running++;
+        p->running++;
 #endif
-        }
-        else if (p->state == SLEEPING)
-        {
-#ifdef PBS
-            p->sleeping++;
-#endif
-        }
-        release(&p->lock);
     }
 }
 
@@ -1248,12 +2089,13 @@ settickets(int new_ticket)
     int old = -1;
 #ifdef LBS
     struct proc* p = myproc();
-    old = p->tickets;
-    p->tickets = new_ticket;
-    if (total_tickets < 0)
+    // A process with no tickets would never run again.
+    if (new_ticket < 1)
     {
-        panic("Negative Tickets");
+        return -1;
     }
+    old = p->tickets;
+    p->tickets = new_ticket;
 #endif
     return old;
 }
@@ -27,6 +27,9 @@ struct context
     uint64 s11;
 };
 
+struct run;
+struct shm;
+
 // Per-CPU state.
 struct cpu
 {
@@ -34,6 +37,28 @@ struct cpu
     struct context context;     // swtch() here to enter scheduler().
     int noff;                   // Depth of push_off() nesting.
     int intena;                 // Were interrupts enabled before push_off()?
+
+    // Free page cache, see kalloc.c.
+    // Only touched by this cpu with interrupts disabled.
+    struct run *freepages;      // Cached free pages.
+    int nfreepages;             // Number of pages in freepages.
+    uint64 kalloc_hits;         // kalloc()s served from freepages.
+    uint64 kalloc_misses;       // kalloc()s that had to refill from kmem.
+    uint64 kfree_drains;        // Batches kfree() handed back to kmem.
+
+    // ASID allocator, see asidget() in vm.c.
+    uint64 asidgen;             // Current generation, above the ASID bits.
+    uint64 nextasid;            // Next ASID to hand out in it.
+    int kstackgen;              // Kernel stacks flushed for, see kstacksync().
+
+#ifdef RR
+    // Run queue, see runqput() in proc.c. Idle cpus
+    // steal from it, so it has a lock.
+    struct spinlock rqlock;
+    struct proc *rqhead;        // Next process to run.
+    struct proc *rqtail;
+    int rqlen;
+#endif
 };
 
 extern struct cpu cpus[NCPU];
@@ -92,6 +117,32 @@ struct trapframe
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A loadable segment of the program a process is running,
+// read from p->execip on demand (see execfault in exec.c).
+#define NEXECSEG 4
+struct execseg
+{
+    uint64 va;                  // Page-aligned start address
+    uint64 memsz;               // Bytes in memory
+    uint64 filesz;              // Bytes backed by the file, the rest is zero
+    uint64 off;                 // File offset of va
+    int perm;                   // PTE permissions
+};
+
+// A region of a file mapped by mmap(), faulted in on
+// first touch, or an attached shared-memory segment
+// (see mmap.c).
+struct vma
+{
+    uint64 addr;                // Page-aligned start, 0 if unused
+    uint64 len;                 // Bytes, a multiple of PGSIZE
+    int prot;                   // PROT_READ, PROT_WRITE
+    int flags;                  // MAP_SHARED or MAP_PRIVATE
+    struct file *f;             // Mapped file, or
+    struct shm *shm;            // shared-memory segment
+    uint off;                   // File offset of addr
+};
+
 // Per-process state
 struct proc
 {
@@ -116,20 +167,38 @@ struct proc
     struct file *ofile[NOFILE];  // Open files
     struct inode *cwd;           // Current directory
     char name[16];               // Process name (debugging)
+    struct inode *execip;        // Executable, for demand paging
+    struct execseg execseg[NEXECSEG]; // Its segments not loaded by exec
+    int nexecseg;
+    int superpages;              // Back large heap regions with megapages
+    uint64 ustacktop;            // Top of the user stack, below the heap
+    uint64 ustacklow;            // Lowest stack page faulted in so far
+    uint64 minflt;               // Page faults resolved without the disk
+    uint64 majflt;               // Page faults that read the disk
+    uint64 cowflt;               // Of the minor ones, COW breaks
+    struct vma vma[NVMA];        // mmap()ed files, above the heap
+    int pinned;                  // uvmprefault() called; don't page out
+    uint64 asid[NCPU];           // Per cpu: generation | ASID, or 0
 
     int alarm;                      // Whether the program has called sigalarm or not.
     int tickCount;                  // Current number of ticks used by the process.
     int alarmTime;                  // The nunmber of ticks after which handler should be called.
     uint64 interruptFunction;       // What is the handler function in sigalarm.
-    struct trapframe *Sigtrapframe; // For the implementation of sigreturn. 
+    struct trapframe *Sigtrapframe; // For sigreturn; allocated by the first sigalarm().
     Bitmask mask;                   // Tracong mask associated with the process
                                     
     // Scheduler Modifications
     int in_tick;                    // Tick value when process is added
     int run_time;                   // How long the process will run in total
     int end_tick;                   // Tick value when process is exited
+    uint64 readyat;                 // time CSR when it last became RUNNABLE
+    uint lathist[NLATBUCKET];       // Waits from RUNNABLE to RUNNING, see waitx()
+
 
 
+#if defined(RR) || defined(MLFQ)
+    struct proc *rqnext;            // Next in a run queue
+#endif
 
 #ifdef FCFS
     // ok
@@ -139,6 +208,9 @@ struct proc
 
 #ifdef LBS
     int tickets;                    // Tickets owned by process
+    uint64 lotweight;               // Its tickets in the draw while RUNNABLE
+    uint64 lotstart;                // time CSR when it was last scheduled
+    uint64 lotused;                 // Cycles run if it slept before the quantum ended
 #endif
 
 
@@ -149,14 +221,28 @@ struct proc
     int num_sched;                  // Number of times process is scheduled
     int running;                    // Time spent running
     int sleeping;                   // Time spent sleeping
+    int sleptat;                    // ticks when it last went to sleep
+    int pbskey;                     // nice_priority() when it became RUNNABLE
+    int heapidx;                    // Index in the run heap, or -1
+#endif
+
+#ifdef CFS
+    uint64 vruntime;                // Cycles run, scaled by 1024/weight
+    uint64 cfsstart;                // time CSR when vruntime was last charged
+    uint64 cfsdispatch;             // time CSR when it was last scheduled
+    uint64 cfsweight;               // Its weight in cfs.load while RUNNABLE
+    struct proc *cfsleft;           // Run tree children, earlier and later
+    struct proc *cfsright;
+    int cfsheight;                  // Of its run subtree
 #endif
 
 #ifdef MLFQ
-#define TOOMUCH(x) ( ( x + 1 ) )
+#define NMLFQ 5
+#define QUANTUM(x) ( 1 << (x) )
 #define MAXWAIT(x) ( 30 )
-    int last_tick;    
-    int queue;
-    int numTicks; 
+    int last_tick;                  // When it entered its queue, or last ran
+    int queue;                      // Level, 0 is the highest
+    int numTicks;                   // Ticks used since it was last scheduled
 #endif
 };
 
@@ -0,0 +1,18 @@
+#ifndef RUSAGE_H
+#define RUSAGE_H
+
+// Memory use of the calling process, filled in by
+// getrusage(). Counts are in pages unless noted.
+struct rusage {
+  uint64 rss;       // pages mapped, megapages counting 512
+  uint64 shared;    // of those, also mapped elsewhere or cached
+  uint64 swapped;   // pages paged out to swap
+  uint64 minflt;    // page faults resolved without the disk
+  uint64 majflt;    // page faults that read the disk
+  uint64 cowflt;    // of the minor faults, COW breaks
+  uint64 stack;     // peak user stack, in bytes
+  uint64 memfree;   // free pages in the whole system
+  uint64 memused;   // allocated pages in the whole system
+};
+
+#endif
@@ -0,0 +1,209 @@
+//
+// Shared-memory segments: shmget(), shmat(), shmdt(), shmrm().
+//
+// A segment is a set of zeroed pages named by an integer
+// key, so that unrelated processes can find it. It holds
+// one reference to each page (see addressMap in kalloc.c)
+// and every attachment another, through its PTEs. An
+// attachment is a vma without a file, so fork(), exit()
+// and exec() handle it as they do mmap()ed files. A segment
+// lasts until shmrm() removes it, which frees its key at
+// once and its pages when the last attachment goes away.
+// An id is the slot plus a generation count, so an id of a
+// removed segment doesn't name the next one in its slot.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fcntl.h"
+
+struct shm {
+  int key;
+  int npages;                 // 0 if this slot is free
+  int nattach;                // vmas that map it
+  int removed;                // by shmrm(); key no longer finds it
+  int gen;                    // id / NSHM
+  uint64 pages[SHMMAXPAGES];
+};
+
+// Generations wrap before ids overflow an int.
+#define SHMMAXGEN (0x7fffffff / NSHM)
+
+struct {
+  struct spinlock lock;
+  struct shm shm[NSHM];
+} shmtab;
+
+void
+shminit(void)
+{
+  initlock(&shmtab.lock, "shm");
+}
+
+// The segment named by id, or 0 if it has been removed.
+// Caller holds shmtab.lock.
+static struct shm *
+shmlookup(int id)
+{
+  struct shm *s;
+
+  if(id < 0)
+    return 0;
+  s = &shmtab.shm[id % NSHM];
+  if(s->npages == 0 || s->removed || s->gen != id / NSHM)
+    return 0;
+  return s;
+}
+
+// Free s's pages and its slot. Caller holds shmtab.lock.
+static void
+shmfree(struct shm *s)
+{
+  int i;
+
+  for(i = 0; i < s->npages; i++)
+    kfree((void*)s->pages[i]);
+  s->npages = 0;
+  s->removed = 0;
+}
+
+// Return the id of the segment named key, creating it with
+// size bytes if it doesn't exist. Returns -1 if size is too
+// large, larger than the existing segment, or memory or
+// segment slots are exhausted.
+int
+shmget(int key, uint64 size)
+{
+  struct shm *s, *free = 0;
+  int i, npages;
+
+  if(size == 0 || size > SHMMAXPAGES * PGSIZE)
+    return -1;
+  npages = PGROUNDUP(size) / PGSIZE;
+
+  acquire(&shmtab.lock);
+  for(s = shmtab.shm; s < &shmtab.shm[NSHM]; s++){
+    if(s->npages && !s->removed && s->key == key){
+      release(&shmtab.lock);
+      return s->npages >= npages ? s->gen * NSHM + (s - shmtab.shm) : -1;
+    }
+    if(s->npages == 0 && free == 0)
+      free = s;
+  }
+  if(free == 0){
+    release(&shmtab.lock);
+    return -1;
+  }
+  for(i = 0; i < npages; i++){
+    if((free->pages[i] = (uint64)kalloc_zeroed()) == 0){
+      while(--i >= 0)
+        kfree((void*)free->pages[i]);
+      release(&shmtab.lock);
+      return -1;
+    }
+  }
+  free->key = key;
+  free->npages = npages;
+  free->nattach = 0;
+  free->gen = (free->gen + 1) % SHMMAXGEN;
+  i = free->gen * NSHM + (free - shmtab.shm);
+  release(&shmtab.lock);
+  return i;
+}
+
+// Remove segment id: its key no longer finds it, and it is
+// freed when no longer attached. Returns 0, or -1 if id
+// doesn't name a segment.
+int
+shmrm(int id)
+{
+  struct shm *s;
+
+  acquire(&shmtab.lock);
+  if((s = shmlookup(id)) == 0){
+    release(&shmtab.lock);
+    return -1;
+  }
+  s->removed = 1;
+  if(s->nattach == 0)
+    shmfree(s);
+  release(&shmtab.lock);
+  return 0;
+}
+
+// Take another attachment reference to s.
+void
+shmdup(struct shm *s)
+{
+  acquire(&shmtab.lock);
+  s->nattach++;
+  release(&shmtab.lock);
+}
+
+// Drop an attachment reference to s; the last one frees
+// the segment if it has been removed.
+void
+shmput(struct shm *s)
+{
+  acquire(&shmtab.lock);
+  if(--s->nattach == 0 && s->removed)
+    shmfree(s);
+  release(&shmtab.lock);
+}
+
+// Map segment id into the current process, readable and
+// writable. Returns its address, or -1.
+uint64
+shmat(int id)
+{
+  struct proc *p = myproc();
+  struct shm *s;
+  struct vma *v;
+  int i;
+
+  // The attachment reference keeps s from being freed
+  // while it is mapped, outside the lock.
+  acquire(&shmtab.lock);
+  if((s = shmlookup(id)) == 0){
+    release(&shmtab.lock);
+    return -1;
+  }
+  s->nattach++;
+  release(&shmtab.lock);
+
+  if((v = vmaalloc(p, s->npages * PGSIZE)) == 0){
+    shmput(s);
+    return -1;
+  }
+  v->prot = PROT_READ | PROT_WRITE;
+  v->flags = MAP_SHARED;
+  v->shm = s;
+  for(i = 0; i < s->npages; i++){
+    if(mappages(p->pagetable, v->addr + i*PGSIZE, PGSIZE, s->pages[i],
+                PTE_R | PTE_W | PTE_U) != 0){
+      munmap(v->addr, v->len);
+      return -1;
+    }
+    pageRef((void*)s->pages[i]);
+  }
+  uvmflush(p);
+  return v->addr;
+}
+
+// Detach the segment attached at addr.
+int
+shmdt(uint64 addr)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->addr == addr && v->f == 0 && v->shm)
+      return munmap(v->addr, v->len);
+  return -1;
+}
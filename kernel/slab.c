@@ -0,0 +1,223 @@
+// Slab allocator for small, fixed-size kernel objects
+// (pipes, open files, in-memory inodes).
+//
+// A kmem_cache hands out objects of a single size. Objects
+// are carved out of one-page slabs obtained from kalloc():
+// each slab starts with a struct slab header, followed by
+// as many objects as fit in the rest of the page. The free
+// objects of a slab are chained through their first word.
+//
+// In front of the slabs, each CPU has a small magazine of
+// free objects, so most kmem_cache_alloc()/kmem_cache_free()
+// calls only disable interrupts and touch per-CPU state.
+// Magazines are refilled from and flushed to the slabs
+// MAGBATCH objects at a time, under the cache's lock.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NCACHE    16  // maximum number of object caches
+#define MAGSIZE   16  // free objects held per CPU per cache
+#define MAGBATCH   8  // objects moved between a magazine and the slabs
+
+struct slab
+{
+    struct slab *next;          // On the cache's partial or full list.
+    struct slab *prev;
+    struct kmem_cache *cache;   // Cache this slab belongs to.
+    void *freelist;             // Free objects in this slab.
+    int inuse;                  // Objects handed out, magazines included.
+};
+
+struct magazine
+{
+    int n;
+    void *obj[MAGSIZE];
+};
+
+struct kmem_cache
+{
+    struct spinlock lock;       // Protects the slab lists.
+    char *name;
+    uint size;                  // Object size, rounded up to 8 bytes.
+    int perslab;                // Objects per slab.
+    struct slab partial;        // Slabs with at least one free object.
+    struct slab full;           // Slabs with none.
+    int nslabs;
+    struct magazine mag[NCPU];  // Only touched by that CPU, interrupts off.
+};
+
+struct kmem_cache caches[NCACHE];
+int ncaches;
+
+static void
+slab_push(struct slab *head, struct slab *s)
+{
+    s->next = head->next;
+    s->prev = head;
+    head->next->prev = s;
+    head->next = s;
+}
+
+static void
+slab_remove(struct slab *s)
+{
+    s->prev->next = s->next;
+    s->next->prev = s->prev;
+}
+
+// Create a cache of objects of the given size.
+// Only called while booting, on one CPU.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+    struct kmem_cache *kc;
+
+    size = (size + 7) & ~7;
+    if( ncaches == NCACHE || size > PGSIZE - sizeof(struct slab) )
+        panic("kmem_cache_create");
+
+    kc = &caches[ncaches++];
+    initlock(&kc->lock, name);
+    kc->name = name;
+    kc->size = size;
+    kc->perslab = (PGSIZE - sizeof(struct slab)) / size;
+    kc->partial.next = kc->partial.prev = &kc->partial;
+    kc->full.next = kc->full.prev = &kc->full;
+    return kc;
+}
+
+// Add a fresh slab to kc's partial list.
+// Caller must hold kc->lock.
+static struct slab*
+slab_grow(struct kmem_cache *kc)
+{
+    struct slab *s;
+    char *obj;
+
+    if( (s = (struct slab*)kalloc()) == 0 )
+        return 0;
+    s->cache = kc;
+    s->inuse = 0;
+    s->freelist = 0;
+    obj = (char*)s + sizeof(struct slab);
+    for( int i = 0; i < kc->perslab; i++, obj += kc->size )
+    {
+        *(void**)obj = s->freelist;
+        s->freelist = obj;
+    }
+    slab_push(&kc->partial, s);
+    kc->nslabs++;
+    return s;
+}
+
+// Take one object from kc's slabs.
+// Caller must hold kc->lock.
+static void*
+slab_take(struct kmem_cache *kc)
+{
+    struct slab *s;
+    void *obj;
+
+    s = kc->partial.next;
+    if( s == &kc->partial && (s = slab_grow(kc)) == 0 )
+        return 0;
+
+    obj = s->freelist;
+    s->freelist = *(void**)obj;
+    s->inuse++;
+    if( s->freelist == 0 )
+    {
+        slab_remove(s);
+        slab_push(&kc->full, s);
+    }
+    return obj;
+}
+
+// Return obj to its slab. A slab that becomes empty is
+// given back to kalloc(), unless it is kc's last one.
+// Caller must hold kc->lock.
+static void
+slab_put(struct kmem_cache *kc, void *obj)
+{
+    struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+
+    if( s->cache != kc || s->inuse <= 0 )
+        panic("kmem_cache_free");
+
+    if( s->freelist == 0 )
+    {
+        slab_remove(s);
+        slab_push(&kc->partial, s);
+    }
+    *(void**)obj = s->freelist;
+    s->freelist = obj;
+    s->inuse--;
+
+    if( s->inuse == 0 && kc->nslabs > 1 )
+    {
+        slab_remove(s);
+        kc->nslabs--;
+        kfree((void*)s);
+    }
+}
+
+// Allocate one object from kc.
+// Its contents are undefined. Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+    struct magazine *m;
+    void *obj = 0;
+
+    push_off();
+    m = &kc->mag[cpuid()];
+    if( m->n == 0 )
+    {
+        acquire(&kc->lock);
+        while( m->n < MAGBATCH && (obj = slab_take(kc)) != 0 )
+            m->obj[m->n++] = obj;
+        release(&kc->lock);
+    }
+    if( m->n > 0 )
+        obj = m->obj[--m->n];
+    pop_off();
+
+    return obj;
+}
+
+// Free an object returned by kmem_cache_alloc(kc).
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+    struct magazine *m;
+
+    push_off();
+    m = &kc->mag[cpuid()];
+    if( m->n == MAGSIZE )
+    {
+        acquire(&kc->lock);
+        while( m->n > MAGSIZE - MAGBATCH )
+            slab_put(kc, m->obj[--m->n]);
+        release(&kc->lock);
+    }
+    m->obj[m->n++] = obj;
+    pop_off();
+}
+
+// Print per-cache slab usage. For debugging.
+void
+slabstat(void)
+{
+    for( int i = 0; i < ncaches; i++ )
+    {
+        struct kmem_cache *kc = &caches[i];
+        printf("slab %s: %d bytes, %d per slab, %d slabs\n",
+               kc->name, kc->size, kc->perslab, kc->nslabs);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+// File descriptor actions for spawn(). They are applied in
+// order to the child's copy of the caller's open files; the
+// list ends with an action whose op is 0.
+#define SPAWN_CLOSE 1   // close fd
+#define SPAWN_DUP   2   // make fd refer to the file open as src
+#define SPAWN_OPEN  3   // open path with omode as fd
+
+#define NSPAWNACT 16    // maximum actions per spawn()
+
+struct spawnact {
+  int op;
+  int fd;
+  int src;
+  int omode;
+  char *path;
+};
+
+#endif
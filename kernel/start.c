@@ -86,4 +86,7 @@ timerinit()
 
     // enable machine-mode timer interrupts.
     w_mie(r_mie() | MIE_MTIE);
+
+    // let supervisor mode read the time CSR.
+    w_mcounteren(r_mcounteren() | 2);
 }
@@ -0,0 +1,270 @@
+//
+// Paging user memory out to the swap area of the disk.
+//
+// mkfs reserves sb.nswap blocks after the file system,
+// starting at sb.swapstart; each run of PGSIZE/BSIZE
+// blocks is a slot holding one page.
+//
+// When kalloc() runs dry, swapout() picks pages with a
+// clock over all processes' heap, data and stack pages,
+// giving a second chance to pages whose PTE_A bit is set.
+// A paged-out PTE has PTE_V clear, PTE_SWAP set and the
+// slot number where the PPN would be, and keeps its other
+// permission bits. Touching it faults, and swapin() reads
+// the page back. fork() shares slots like pages, so each
+// slot counts the PTEs that name it.
+//
+// Only pages mapped by a single PTE are paged out, and
+// only from processes that are not running, or from the
+// caller. Pages of mmap()ed files and shared-memory
+// segments stay resident.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+
+#define SLOTBLOCKS (PGSIZE / BSIZE)
+
+extern struct superblock sb;
+extern struct proc proc[];
+
+struct {
+  struct spinlock lock;
+  uchar ref[NSWAP];         // PTEs naming each slot
+  uchar busy[NSWAP];        // still being written out
+  int nslot;                // usable slots, from the super block
+  int used;
+  // The clock hand: next process and address to look at.
+  int hand;
+  uint64 handva;
+
+  struct sleeplock iolock;  // protects buf
+  struct buf buf;
+} swap;
+
+void
+swapinit(void)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.iolock, "swapio");
+}
+
+// Read or write the page at pa from or to slot.
+static void
+swapio(int slot, char *pa, int write)
+{
+  int i;
+
+  acquiresleep(&swap.iolock);
+  for(i = 0; i < SLOTBLOCKS; i++){
+    swap.buf.dev = ROOTDEV;
+    swap.buf.blockno = sb.swapstart + slot * SLOTBLOCKS + i;
+    if(write)
+      memmove(swap.buf.data, pa + i * BSIZE, BSIZE);
+    virtio_disk_rw(&swap.buf, write);
+    if(!write)
+      memmove(pa + i * BSIZE, swap.buf.data, BSIZE);
+  }
+  releasesleep(&swap.iolock);
+}
+
+// Allocate a slot, marked busy. Returns -1 if swap is full.
+// Caller must hold swap.lock.
+static int
+slotalloc(void)
+{
+  int i;
+
+  // The super block isn't read until the first process runs.
+  if(swap.nslot == 0)
+    swap.nslot = sb.nswap / SLOTBLOCKS < NSWAP ? sb.nswap / SLOTBLOCKS : NSWAP;
+  for(i = 0; i < swap.nslot; i++){
+    if(swap.ref[i] == 0){
+      swap.ref[i] = 1;
+      swap.busy[i] = 1;
+      swap.used++;
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Record one more PTE naming the slot in pte, for fork().
+void
+swapdup(pte_t pte)
+{
+  acquire(&swap.lock);
+  swap.ref[PTE2SLOT(pte)]++;
+  release(&swap.lock);
+}
+
+// Drop the reference of a PTE to its slot.
+void
+swapfree(pte_t pte)
+{
+  int slot = PTE2SLOT(pte);
+
+  acquire(&swap.lock);
+  if(swap.ref[slot] == 0)
+    panic("swapfree");
+  if(--swap.ref[slot] == 0)
+    swap.used--;
+  release(&swap.lock);
+}
+
+// May the caller sleep for disk I/O? Not from the
+// scheduler, and not while holding a spinlock.
+static int
+cansleep(void)
+{
+  int ok;
+
+  push_off();
+  ok = mycpu()->noff == 1 && mycpu()->intena && myproc() != 0;
+  pop_off();
+  return ok;
+}
+
+// Take the page of the user PTE at pte if the clock says
+// it hasn't been used lately: give it a slot and turn pte
+// into a swapped-out PTE. Returns the page, or 0. Caller
+// must hold the lock of the process that owns pte.
+static char *
+victim(pte_t *pte, int *slot)
+{
+  uint64 pa;
+
+  if((*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U) || (*pte & PTE_COW))
+    return 0;
+  pa = PTE2PA(*pte);
+  if(pageRefCount((void*)pa) != 1)
+    return 0;
+  if(*pte & PTE_A){
+    // Second chance. swapout() flushes the TLB entry, so
+    // the bit is set again on the next use.
+    *pte &= ~PTE_A;
+    return 0;
+  }
+  acquire(&swap.lock);
+  *slot = slotalloc();
+  release(&swap.lock);
+  if(*slot < 0)
+    return 0;
+  *pte = SLOT2PTE(*slot) | (PTE_FLAGS(*pte) & ~(PTE_V | PTE_A | PTE_D)) | PTE_SWAP;
+  return (char*)pa;
+}
+
+// Page out up to n pages of user memory to make room for
+// kalloc(). Returns the number of pages freed, which is 0
+// if the caller can't sleep or nothing can be paged out.
+int
+swapout(int n)
+{
+  char *pages[SWAPBATCH];
+  int slots[SWAPBATCH];
+  struct proc *p;
+  pagetable_t l0;
+  pte_t *l1;
+  uint64 va;
+  int got = 0, scanned = 0, i, hand;
+
+  if(n > SWAPBATCH)
+    n = SWAPBATCH;
+  if(!cansleep())
+    return 0;
+
+  // Two turns of the clock find a victim if there is one:
+  // the first clears the reference bits the second tests.
+  acquire(&swap.lock);
+  hand = swap.hand;
+  va = swap.handva;
+  release(&swap.lock);
+  while(got < n && scanned <= 2 * NPROC){
+    p = &proc[hand];
+    acquire(&p->lock);
+    if(p->pagetable && !p->pinned &&
+       (p == myproc() || p->state == RUNNABLE || p->state == SLEEPING)){
+      for(; got < n && va < p->sz; va += PGSIZE){
+        l1 = walkmega(p->pagetable, va, 0);
+        if(l1 == 0 || (*l1 & PTE_V) == 0 || PTE_LEAF(*l1)){
+          // Nothing here, or a megapage, which stays.
+          va = SUPERPGROUNDDOWN(va) + SUPERPGSIZE - PGSIZE;
+          continue;
+        }
+        l0 = (pagetable_t)PTE2PA(*l1);
+        if((pages[got] = victim(&l0[PX(0, va)], &slots[got])) != 0)
+          got++;
+      }
+      uvmflush(p);
+    }
+    if(got < n){
+      hand = (hand + 1) % NPROC;
+      va = 0;
+      scanned++;
+    }
+    release(&p->lock);
+  }
+  acquire(&swap.lock);
+  swap.hand = hand;
+  swap.handva = va;
+  release(&swap.lock);
+
+  // The PTEs no longer name the pages, so they can be
+  // written out without holding any lock.
+  for(i = 0; i < got; i++){
+    swapio(slots[i], pages[i], 1);
+    acquire(&swap.lock);
+    swap.busy[slots[i]] = 0;
+    release(&swap.lock);
+    // Not under swap.lock: wakeup() takes every p->lock, and
+    // swap.lock is taken with a p->lock held. swapin() checks
+    // busy under swap.lock, so the wakeup can't be missed.
+    wakeup(&swap.busy[slots[i]]);
+    kfree(pages[i]);
+  }
+  return got;
+}
+
+// Read back the page of p at va if it was paged out.
+// Returns 0 if it is now mapped, -1 on failure, and 1
+// if va wasn't paged out. If cansleep is 0 the disk
+// can't be read and the fault fails.
+int
+swapin(struct proc *p, uint64 va, int cansleep)
+{
+  pte_t *pte;
+  char *mem;
+  int slot;
+
+  if(va >= MAXVA)
+    return 1;
+  va = PGROUNDDOWN(va);
+  if((pte = walk(p->pagetable, va, 0)) == 0 || (*pte & PTE_SWAP) == 0)
+    return 1;
+  if(!cansleep)
+    return -1;
+  if((mem = kalloc()) == 0)
+    return -1;
+
+  // Only p changes its own swapped-out PTEs, so pte still
+  // names the same slot after sleeping.
+  slot = PTE2SLOT(*pte);
+  acquire(&swap.lock);
+  while(swap.busy[slot])
+    sleep(&swap.busy[slot], &swap.lock);
+  release(&swap.lock);
+  swapio(slot, mem, 0);
+
+  swapfree(*pte);
+  *pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~PTE_SWAP) | PTE_V | PTE_A;
+  return 0;
+}
+
@@ -108,6 +108,15 @@ extern uint64 sys_sigalarm(void);
 extern uint64 sys_sigreturn(void);
 extern uint64 sys_set_priority(void);
 extern uint64 sys_settickets(void);
+extern uint64 sys_superpages(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_shmget(void);
+extern uint64 sys_shmat(void);
+extern uint64 sys_shmdt(void);
+extern uint64 sys_getrusage(void);
+extern uint64 sys_shmrm(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -139,6 +148,15 @@ static uint64 (*syscalls[])(void) = {
 [SYS_waitx] = sys_waitx,
 [SYS_set_priority] = sys_set_priority,
 [SYS_settickets] = sys_settickets,
+[SYS_superpages] = sys_superpages,
+[SYS_spawn] = sys_spawn,
+[SYS_mmap] = sys_mmap,
+[SYS_munmap] = sys_munmap,
+[SYS_shmget] = sys_shmget,
+[SYS_shmat] = sys_shmat,
+[SYS_shmdt] = sys_shmdt,
+[SYS_getrusage] = sys_getrusage,
+[SYS_shmrm] = sys_shmrm,
 };
 
 static char * SysCallName[ NELEM(syscalls) + 1 ] = {"", "fork", "exit", "wait", "pipe",
@@ -146,13 +164,15 @@ static char * SysCallName[ NELEM(syscalls) + 1 ] = {"", "fork", "exit", "wait",
                                             "dup", "getpid", "sbrk", "sleep", "uptime",
                                             "open", "write", "mknod", "unlink", "link",
                                             "mkdir", "close", "trace", "sigalarm", "sigreturn",
-                                            "waitx", "set_priority", "settickets"};
+                                            "waitx", "set_priority", "settickets", "superpages", "spawn", "mmap", "munmap",
+                                            "shmget", "shmat", "shmdt", "getrusage", "shmrm"};
 static int SysCallNumArgs[ NELEM(syscalls) + 1] = { 0, 0, 1, 1, 1,
                                                     3, 1, 2, 2, 1,
                                                     1, 0, 1, 1, 1,
                                                     2, 3, 3, 1, 2,
                                                     1, 1, 1, 2, 0,
-                                                    3, 2, 1};
+                                                    4, 2, 1, 1, 3, 6, 2,
+                                                    2, 1, 1, 1, 1};
 void
 syscall(void)
 {
@@ -164,16 +184,18 @@ syscall(void)
     // Use num to lookup the system call function for num, call it,
     // and store its return value in p->trapframe->a0
     
-    int Arguments[5];
+    int Arguments[6];
 
     for ( int i = 0; i < SysCallNumArgs[num]; i++ )
         argint( i , &Arguments[i]);
 
-    int SysCallReturnValue = (int)syscalls[num]();
-    p->trapframe->a0 = SysCallReturnValue;
+    // Keep all 64 bits: mmap() returns an address.
+    p->trapframe->a0 = syscalls[num]();
+    int SysCallReturnValue = (int)p->trapframe->a0;
 
     Bitmask TraceMask = p->mask; 
-    Bitmask ProcessMask = (1 << num );  // 1 << 22 at max
+    // Only the first 32 system calls can be traced.
+    Bitmask ProcessMask = num < 32 ? (Bitmask)(1U << num) : 0;
     int ProcessPID = p->pid;
 
     if ( num > 0 && TraceMask & ProcessMask )
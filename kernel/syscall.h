@@ -30,5 +30,14 @@
 #define SYS_waitx           25
 #define SYS_set_priority    26
 #define SYS_settickets      27
+#define SYS_superpages      28
+#define SYS_spawn           29
+#define SYS_mmap            30
+#define SYS_munmap          31
+#define SYS_shmget          32
+#define SYS_shmat           33
+#define SYS_shmdt           34
+#define SYS_getrusage       35
+#define SYS_shmrm           36
 
 #endif
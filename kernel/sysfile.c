@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "spawn.h"
 
 
 // Fetch the nth word-sized system call argument as a file descriptor
@@ -302,18 +303,13 @@ create(char *path, short type, short major, short minor)
   return 0;
 }
 
-uint64
-sys_open(void)
+// Open path with omode, for open() and spawn().
+// Returns the new file, or 0 on failure.
+static struct file*
+openfile(char *path, int omode)
 {
-  char path[MAXPATH];
-  int fd, omode;
   struct file *f;
   struct inode *ip;
-  int n;
-
-  argint(1, &omode);
-  if((n = argstr(0, path, MAXPATH)) < 0)
-    return -1;
 
   begin_op();
 
@@ -321,33 +317,31 @@ sys_open(void)
     ip = create(path, T_FILE, 0, 0);
     if(ip == 0){
       end_op();
-      return -1;
+      return 0;
     }
   } else {
     if((ip = namei(path)) == 0){
       end_op();
-      return -1;
+      return 0;
     }
     ilock(ip);
     if(ip->type == T_DIR && omode != O_RDONLY){
       iunlockput(ip);
       end_op();
-      return -1;
+      return 0;
     }
   }
 
   if(ip->type == T_DEVICE && (ip->major < 0 || ip->major >= NDEV)){
     iunlockput(ip);
     end_op();
-    return -1;
+    return 0;
   }
 
-  if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
-    if(f)
-      fileclose(f);
+  if((f = filealloc()) == 0){
     iunlockput(ip);
     end_op();
-    return -1;
+    return 0;
   }
 
   if(ip->type == T_DEVICE){
@@ -368,6 +362,26 @@ sys_open(void)
   iunlock(ip);
   end_op();
 
+  return f;
+}
+
+uint64
+sys_open(void)
+{
+  char path[MAXPATH];
+  int fd, omode;
+  struct file *f;
+
+  argint(1, &omode);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+
+  if((f = openfile(path, omode)) == 0)
+    return -1;
+  if((fd = fdalloc(f)) < 0){
+    fileclose(f);
+    return -1;
+  }
   return fd;
 }
 
@@ -432,24 +446,22 @@ sys_chdir(void)
   return 0;
 }
 
-uint64
-sys_exec(void)
+// Copy the user argument vector at uargv into argv,
+// one kalloc()ed page per string. The caller frees them
+// with argvfree(), whether or not this succeeds.
+static int
+argvfetch(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  argaddr(1, &uargv);
-  if(argstr(0, path, MAXPATH) < 0) {
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG * sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
-      goto bad;
+    if(i >= MAXARG){
+      return -1;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
-      goto bad;
+      return -1;
     }
     if(uarg == 0){
       argv[i] = 0;
@@ -457,22 +469,115 @@ sys_exec(void)
     }
     argv[i] = kalloc();
     if(argv[i] == 0)
-      goto bad;
+      return -1;
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
-      goto bad;
+      return -1;
   }
+  return 0;
+}
 
-  int ret = exec(path, argv);
+static void
+argvfree(char **argv)
+{
+  int i;
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
+  for(i = 0; i < MAXARG && argv[i] != 0; i++)
     kfree(argv[i]);
+}
+
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+  int ret = -1;
 
+  argaddr(1, &uargv);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if(argvfetch(uargv, argv) == 0)
+    ret = exec(path, argv);
+  argvfree(argv);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+// Apply the spawn() action at uact to the file table ofile.
+// Returns 1 for the terminating action, 0 after applying
+// one, -1 if it is invalid.
+static int
+spawnact(uint64 uact, struct file **ofile)
+{
+  struct spawnact act;
+  char path[MAXPATH];
+  struct file *f = 0;
+
+  if(copyin(myproc()->pagetable, (char*)&act, uact, sizeof(act)) < 0)
+    return -1;
+  if(act.op == 0)
+    return 1;
+  if(act.fd < 0 || act.fd >= NOFILE)
+    return -1;
+
+  switch(act.op){
+  case SPAWN_CLOSE:
+    break;
+  case SPAWN_DUP:
+    if(act.src < 0 || act.src >= NOFILE || ofile[act.src] == 0)
+      return -1;
+    f = filedup(ofile[act.src]);
+    break;
+  case SPAWN_OPEN:
+    if(fetchstr((uint64)act.path, path, MAXPATH) < 0)
+      return -1;
+    if((f = openfile(path, act.omode)) == 0)
+      return -1;
+    break;
+  default:
+    return -1;
+  }
+
+  if(ofile[act.fd])
+    fileclose(ofile[act.fd]);
+  ofile[act.fd] = f;
+  return 0;
+}
+
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  struct file *ofile[NOFILE];
+  struct proc *p = myproc();
+  uint64 uargv, uacts;
+  int i, r, ret = -1;
+
+  argaddr(1, &uargv);
+  argaddr(2, &uacts);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  if(argvfetch(uargv, argv) < 0)
+    goto out;
+
+  // The child starts with the caller's files, then the actions.
+  for(i = 0; i < NOFILE; i++)
+    ofile[i] = p->ofile[i] ? filedup(p->ofile[i]) : 0;
+  for(i = 0; uacts != 0; i++){
+    if(i == NSPAWNACT || (r = spawnact(uacts + i*sizeof(struct spawnact), ofile)) < 0){
+      for(i = 0; i < NOFILE; i++)
+        if(ofile[i])
+          fileclose(ofile[i]);
+      goto out;
+    }
+    if(r == 1)
+      break;
+  }
+
+  ret = spawn(path, argv, ofile);
+
+ out:
+  argvfree(argv);
+  return ret;
 }
 
 uint64
@@ -504,3 +609,32 @@ sys_pipe(void)
   }
   return 0;
 }
+
+uint64
+sys_mmap(void)
+{
+  uint64 len;
+  int prot, flags, off;
+  struct file *f;
+
+  // Argument 0, the address hint, is ignored.
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  if(argfd(4, 0, &f) < 0)
+    return -1;
+  argint(5, &off);
+  if(off < 0)
+    return -1;
+  return mmap(len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
+}
@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "rusage.h"
 
 uint64
 sys_exit(void)
@@ -124,8 +125,15 @@ sys_sigalarm(void)
         return 0;
     }
 
-    //myproc()->Sigtrapframe = myproc()->trapframe;
-    
+    // Most processes never set an alarm, so the frame the
+    // handler's registers are saved in is allocated here.
+    if(myproc()->Sigtrapframe == 0 &&
+       (myproc()->Sigtrapframe = (struct trapframe *)kalloc()) == 0)
+    {
+        myproc()->alarm = 0;
+        return -1;
+    }
+
     myproc()->alarm = 1;
     myproc()->alarmTime = timeInterval; 
     myproc()->interruptFunction = functionPointer;
@@ -142,7 +150,11 @@ uint64
 sys_sigreturn(void)
 {
     struct proc *currProcess = myproc();
-    
+
+    if(currProcess->Sigtrapframe == 0)
+    {
+        return -1;
+    }
     currProcess->Sigtrapframe->kernel_hartid = currProcess->trapframe->kernel_hartid;
     currProcess->Sigtrapframe->kernel_satp = currProcess->trapframe->kernel_satp;
     currProcess->Sigtrapframe->kernel_sp = currProcess->trapframe->kernel_sp;
@@ -160,12 +172,14 @@ sys_sigreturn(void)
 uint64
 sys_waitx(void)
 {
-    uint64 p, raddr, waddr;
+    uint64 p, raddr, waddr, laddr;
     int rtime, wtime;
+    uint lathist[NLATBUCKET];
     argaddr(0, &p);
     argaddr(1, &raddr);
     argaddr(2, &waddr);
-    int ret = waitx(p,&rtime,&wtime);
+    argaddr(3, &laddr);
+    int ret = waitx(p,&rtime,&wtime,lathist);
     struct proc *proc = myproc();
     if (copyout(proc->pagetable, raddr, (char*)&rtime , sizeof(int)) < 0)
     {
@@ -175,6 +189,10 @@ sys_waitx(void)
     {
         return -1;
     }
+    if (ret >= 0 && laddr != 0 && copyout(proc->pagetable, laddr, (char*)lathist, sizeof(lathist)) < 0)
+    {
+        return -1;
+    }
     return ret;
 }
 
@@ -194,3 +212,63 @@ sys_settickets(void)
     argint(0, &new_ticket);
     return settickets(new_ticket);
 }
+
+// Opt in to (on != 0) or out of 2 MiB megapages for heap
+// regions faulted in from now on. Returns the old setting.
+uint64
+sys_superpages(void)
+{
+    int on, old;
+    struct proc *p = myproc();
+    argint(0, &on);
+    old = p->superpages;
+    p->superpages = (on != 0);
+    return old;
+}
+
+uint64
+sys_shmget(void)
+{
+    int key;
+    uint64 size;
+    argint(0, &key);
+    argaddr(1, &size);
+    return shmget(key, size);
+}
+
+uint64
+sys_shmat(void)
+{
+    int id;
+    argint(0, &id);
+    return shmat(id);
+}
+
+uint64
+sys_shmdt(void)
+{
+    uint64 addr;
+    argaddr(0, &addr);
+    return shmdt(addr);
+}
+
+uint64
+sys_shmrm(void)
+{
+    int id;
+    argint(0, &id);
+    return shmrm(id);
+}
+
+uint64
+sys_getrusage(void)
+{
+    uint64 addr;
+    struct rusage ru;
+    struct proc *p = myproc();
+    argaddr(0, &addr);
+    uvmusage(p, &ru);
+    if(copyout(p->pagetable, addr, (char*)&ru, sizeof(ru)) < 0)
+        return -1;
+    return 0;
+}
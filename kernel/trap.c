@@ -6,8 +6,6 @@
 #include "proc.h"
 #include "defs.h"
 
-extern struct proc proc[];
-
 struct spinlock tickslock;
 uint ticks;
 
@@ -72,67 +70,31 @@ usertrap(void)
 
         syscall();
     }
-    else if ( r_scause() == 15 || r_scause() == 13 )
+    else if ( r_scause() == 15 || r_scause() == 13 || r_scause() == 12 )
     {
-        // Page Fault detected.
+        // Store, load or instruction page fault. exec() maps
+        // only cached program pages, so the first fetch from
+        // a new program faults here too.
         // If the COW flag is raised, then the fault should be handled.
         // uint64 pageStart = PGROUNDDOWN( r_stval() ); 
         uint64 pageStart = r_stval();
 
-        if ( pageStart >= MAXVA || ((uint64)pageStart>=PGROUNDDOWN(p->trapframe->sp)-PGSIZE&&(uint64)pageStart<=PGROUNDDOWN(p->trapframe->sp)) || pageStart <= 0 )
+        // Bringing in program or paged-out pages may read the disk.
+        intr_on();
+
+        // The stack guard page is refused by uvmfault(), which
+        // must see faults on the stack itself: it may be paged out.
+        if ( pageStart >= MAXVA )
         {
             setkilled(p);
         }
-        else
+        else if ( uvmfault( p, pageStart, r_scause() == 15, r_scause() == 12, 1 ) < 0 )
         {
-            pte_t *pageTableEntry;
-            pageTableEntry = walk( p->pagetable, pageStart, 0 );
-            // No allocation is needed.
-
-            if ( pageTableEntry == 0 )
-            {
-                // printf("Unavailable Address Refferenced.\n");
-                printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
-                printf("             sepc=%p stval=%p\n", r_sepc(), r_stval());
-                setkilled(p);
-                // Kill the process, since
-                // this should not have happened 
-                // in the COW-fork scheme.
-                // usertrapret();
-            }
-            else if ( PTE_COW & *pageTableEntry )
-            {
-                char *physicalAddress = (char *)PTE2PA(*pageTableEntry);
-                uint64 flags = PTE_FLAGS(*pageTableEntry);
-
-                if ( (PTE_V & *pageTableEntry) && ( PTE_U & *pageTableEntry) && ( PTE_COW & *pageTableEntry) )
-                {
-                    // This is where the code should end up in case of cow-fork.
-
-                    flags |= PTE_W;
-                    flags &= (~PTE_COW);
-
-                    char *newMemory = kalloc();
-
-                    if ( newMemory == 0 )
-                    {
-                        setkilled(p);
-                        exit(-1);
-                    }
-                    memmove( newMemory, (void*)physicalAddress, PGSIZE);
-
-                    *pageTableEntry = PA2PTE(newMemory) | flags ;
-                    // Instead of unmapping and remapping, the flag is directly modified.
-
-                    kfree((void*)physicalAddress);
-                }
-            }
-            else
-            {
-                printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
-                printf("             sepc=%p stval=%p\n", r_sepc(), r_stval());
-                setkilled(p);
-            }
+            // Not a COW page, program page, paged-out page or
+            // untouched heap, or out of memory and swap.
+            printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
+            printf("             sepc=%p stval=%p\n", r_sepc(), r_stval());
+            setkilled(p);
         }
     }
     else if((which_dev = devintr()) != 0)
@@ -172,25 +134,16 @@ usertrap(void)
 #endif
 
 #ifdef MLFQ
-        // printf("Pid Of CurrProc : %d, QueueLevel : %d\n", p->pid, p->queue);
-        p->numTicks++;
-        if ( p->numTicks >= ( 1 << ( p->queue ) ) )
+        if(mlfqtick(p))
         {
             yield();
         }
-        else
+#endif
+
+#ifdef CFS
+        if(cfstick(p))
         {
-            for( struct proc * t = proc; t < &proc[NPROC]; t++ )
-            {
-                acquire(&t->lock);
-                if ( t->state == RUNNABLE && t->queue < p->queue )
-                {
-                    release(&t->lock);
-                    yield();
-                    break;
-                }
-                release(&t->lock);
-            }
+            yield();
         }
 #endif
 
@@ -223,6 +176,9 @@ usertrapret(void)
 {
   struct proc *p = myproc();
 
+  // Pages prefaulted for the system call may be paged out again.
+  p->pinned = 0;
+
   // we're about to switch the destination of traps from
   // kerneltrap() to usertrap(), so turn off interrupts until
   // we're back in user space, where usertrap() is correct.
@@ -251,8 +207,9 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to,
+  // tagged with p's address-space identifier.
+  uint64 satp = MAKE_SATP(p->pagetable) | (asidget(p) << SATP_ASID_SHIFT);
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -298,26 +255,16 @@ kerneltrap()
 #endif
 
 #ifdef MLFQ
-        myproc()->numTicks++;
-
-        if ( myproc()->numTicks >= ( 1 << ( myproc()->queue ) ) )
+        if(mlfqtick(myproc()))
         {
-            myproc()->numTicks = 0;
             yield();
         }
-        else
+#endif
+
+#ifdef CFS
+        if(cfstick(myproc()))
         {
-            for( struct proc * t = proc; t < &proc[NPROC]; t++ )
-            {
-                acquire(&t->lock);
-                if ( t->state == RUNNABLE && t->queue < myproc()->queue )
-                {
-                    release(&t->lock);
-                    yield();
-                    break;
-                }
-                release(&t->lock);
-            }
+            yield();
         }
 #endif
 
@@ -350,37 +297,9 @@ clockintr()
     acquire(&tickslock);
     ticks++;
 
-#ifdef MLFQ 
-    // printf("yahan bhi pahunch gaya.\n"); 
-    for( struct proc *p = proc; p < &proc[NPROC]; p++ )
-    {
-        acquire(&p->lock);
-        if ( p->state != RUNNABLE )
-        {
-            release(&p->lock);
-            continue;
-        }
-        if (  ticks - p->in_tick >= ( 1 << p->queue ) && p->queue < 4 )
-        {
-            p->last_tick = ticks;
-#ifdef YES
-            printf("[%d] queue for %d changed from %d to %d\n", ticks, p->pid, p->queue, p->queue + 1);
-#endif
-            p->queue++;
-        }
-        else if ( ticks - p->last_tick >= 30 && p->queue > 0 )
-        {
-            p->last_tick = ticks;
-#ifdef YES
-            printf("[%d] queue for %d changed from %d to %d\n", ticks, p->pid, p->queue, p->queue - 1);
-#endif
-            p->queue--;
-        }
-        release(&p->lock);
-    }
-
+#ifdef MLFQ
+    mlfqage();
 #endif
-    update_time();
     wakeup(&ticks);
     release(&tickslock);
 }
@@ -424,6 +343,7 @@ devintr()
     if(cpuid() == 0){
       clockintr();
     }
+    update_time();
     
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
@@ -7,6 +7,7 @@
 #include "defs.h"
 #include "fs.h"
 #include "proc.h"
+#include "rusage.h"
 
 
 /*
@@ -17,15 +18,21 @@ pagetable_t kernel_pagetable;
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
-extern void pageRef(void*);
+
+// The ASIDs the hardware implements, as a mask; 0 if none.
+static uint64 asidmask;
+
+// A page of zeroes, mapped read-only wherever user memory
+// is read before it is written. It is never freed.
+static uint64 zeropa;
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -40,13 +47,14 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // mappages() uses megapages from the first 2 MiB boundary on.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // allocate and map a kernel stack for each process.
+  // page-table pages for the kernel stacks, allocated by allocproc().
   proc_mapstacks(kpgtbl);
   
   return kpgtbl;
@@ -57,6 +65,8 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  if((zeropa = (uint64)kalloc_zeroed()) == 0)
+    panic("kvminit: zero page");
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -67,12 +77,99 @@ kvminithart()
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
+  // Find out how many ASID bits there are: the ones
+  // that stick when all are written.
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID_MASK);
+  asidmask = (r_satp() & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
   w_satp(MAKE_SATP(kernel_pagetable));
+  mycpu()->asidgen = asidmask + 1;
+  mycpu()->nextasid = 1;
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Return the ASID that p runs under on this CPU for
+// usertrapret(). Each CPU hands out its own ASIDs, so
+// p gets a new one when it comes to a CPU, or after
+// uvmflush(), and no other CPU has to be told. When a
+// CPU runs out, it starts a new generation with a full
+// TLB flush. Returns 0 if the hardware has no ASIDs;
+// userret then flushes the TLB itself.
+// Interrupts must be off.
+uint64
+asidget(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 *a = &p->asid[cpuid()];
+
+  if(asidmask == 0)
+    return 0;
+  if((*a & ~asidmask) != c->asidgen){
+    if(c->nextasid > asidmask){
+      c->asidgen += asidmask + 1;
+      c->nextasid = 1;
+      sfence_vma();
+    }
+    *a = c->asidgen | c->nextasid++;
+    // The ASID may have been used in the old generation, and
+    // another CPU may have written p's page table.
+    sfence_vma_asid(*a & asidmask);
+  }
+  return *a & asidmask;
+}
+
+// Discard p's cached translations after its page table
+// changed: flush them from this CPU's TLB, page va only
+// unless va is -1, and make the other CPUs give p a new
+// ASID, which none of their stale entries can match.
+// p must not be running on another CPU. If others is 0,
+// the other CPUs are left alone.
+static void
+tlbinval(struct proc *p, uint64 va, int others)
+{
+  int i, id;
+  uint64 a;
+
+  push_off();
+  id = cpuid();
+  for(i = 0; i < NCPU && others; i++)
+    if(i != id)
+      p->asid[i] = 0;
+  a = p->asid[id];
+  if(asidmask && (a & ~asidmask) == mycpu()->asidgen){
+    if(va == -1)
+      sfence_vma_asid(a & asidmask);
+    else
+      sfence_vma_page(PGROUNDDOWN(va), a & asidmask);
+  }
+  pop_off();
+}
+
+// Flush all of p's cached translations.
+void
+uvmflush(struct proc *p)
+{
+  tlbinval(p, -1, 1);
+}
+
+// Flush p's cached translation of page va.
+void
+uvmflushpage(struct proc *p, uint64 va)
+{
+  tlbinval(p, va, 1);
+}
+
+// Flush p's translation of page va from this CPU's TLB
+// only, after its PTE went from invalid to valid. Another
+// CPU that cached the invalid PTE takes a fault on it,
+// which uvmfault() treats as spurious and flushes there.
+static void
+uvmflushlocal(struct proc *p, uint64 va)
+{
+  tlbinval(p, va, 0);
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -85,26 +182,88 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If va lies in a megapage, the level-1 leaf PTE that maps
+// it is returned instead; walklevel() says which it was.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, alloc, 0);
+}
+
+// Like walk(), but also set *level to the level of the
+// returned PTE: 1 for a megapage, 0 for an ordinary page.
+pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > 0; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte)){
+        if(level)
+          *level = l;
+        return pte;
+      }
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
+  if(level)
+    *level = 0;
   return &pagetable[PX(0, va)];
 }
 
+// Return the level-1 PTE for va, which maps a megapage
+// if it is a leaf. If alloc!=0, create the level-1
+// page-table page if needed.
+pte_t *
+walkmega(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+
+  if(*pte & PTE_V) {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  return &pagetable[PX(1, va)];
+}
+
+// The physical address of the page holding va, given
+// the leaf PTE that maps it and that PTE's level.
+static uint64
+leafpa(pte_t pte, int level, uint64 va)
+{
+  return PTE2PA(pte) + (va & ((1L << PXSHIFT(level)) - 1) & ~(PGSIZE - 1));
+}
+
+// Replace the megapage mapped by *pte with a page-table
+// page of ordinary PTEs for the same memory, so that its
+// pages can be unmapped or shared one at a time.
+// Returns 0 on success, -1 if out of memory.
+static int
+demote(pte_t *pte)
+{
+  pagetable_t pt;
+  uint64 pa = PTE2PA(*pte);
+  uint64 flags = PTE_FLAGS(*pte);
+
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -112,20 +271,19 @@ uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
-  uint64 pa;
+  int level;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
-  return pa;
+  return leafpa(*pte, level, va);
 }
 
 // add a mapping to the kernel page table.
@@ -140,12 +298,14 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
-// allocate a needed page-table page.
+// be page-aligned. Wherever va and pa are both 2 MiB aligned
+// and at least 2 MiB remain, a single megapage PTE is used.
+// Returns 0 on success, -1 if walk() couldn't allocate a
+// needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, step;
   pte_t *pte;
 
   if(size == 0)
@@ -154,44 +314,93 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    if(a % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 &&
+       last - a >= SUPERPGSIZE - PGSIZE){
+      pte = walkmega(pagetable, a, 1);
+      step = SUPERPGSIZE;
+    } else {
+      pte = walk(pagetable, a, 1);
+      step = PGSIZE;
+    }
+    if(pte == 0)
       return -1;
     if(*pte & PTE_V)
         panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    if(a + step - PGSIZE == last)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += step;
+    pa += step;
   }
   return 0;
 }
 
+// Demote the megapage holding va, if there is one and va
+// is not its start. Returns 0, or -1 if out of memory.
+static int
+splitat(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if(va % SUPERPGSIZE == 0 || va >= MAXVA)
+    return 0;
+  if((pte = walkmega(pagetable, va, 0)) == 0 ||
+     (*pte & PTE_V) == 0 || !PTE_LEAF(*pte))
+    return 0;
+  return demote(pte);
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
-void
+// page-aligned. Pages that were never faulted in (see
+// growproc) are skipped. Optionally free the physical memory,
+// or the swap slot of a page that was paged out.
+// Returns 0, or -1 with nothing unmapped if a megapage only
+// partly in the range can't be split for lack of memory.
+int
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end = va + npages*PGSIZE;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+  // Only the megapages at the two ends can be partly in
+  // the range. Split them before anything is unmapped.
+  if(splitat(pagetable, va) != 0 || splitat(pagetable, end) != 0)
+    return -1;
+
+  for(a = va; a < end; a += PGSIZE){
+    if((pte = walklevel(pagetable, a, 0, &level)) == 0)
+      continue;
+    if(*pte & PTE_SWAP){
+      if(do_free)
+        swapfree(*pte);
+      *pte = 0;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(level > 0){
+      // A megapage in the range goes in one step.
+      if(a % SUPERPGSIZE != 0 || a + SUPERPGSIZE > end)
+        panic("uvmunmap: megapage");
+      if(do_free)
+        kfree_pages((void*)PTE2PA(*pte), SUPERPAGE_ORDER);
+      *pte = 0;
+      a += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
     }
     *pte = 0;
   }
+  return 0;
 }
 
 // create an empty user page table.
@@ -200,10 +409,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -217,8 +425,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -236,13 +443,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
-      
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -255,7 +460,8 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz
+// with nothing freed if uvmunmap() fails.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -264,7 +470,8 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
     
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    if(uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1) != 0)
+      return oldsz;
   }
 
   return newsz;
@@ -302,63 +509,394 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Pages are shared copy-on-write; see uvmshare().
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
-  uint64 pa, i;
-  uint flags;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
-    pa = PTE2PA(*pte);
-    
-    flags = PTE_FLAGS(*pte);
-
-    if ( flags & PTE_W )
-    {
-        flags |= PTE_COW;
-        // Enabling copy on write for the pagetable.
-        flags &= ~(PTE_W);
-        // Writable permissions removed for the pagetable.
-    }
-
-    if ( mappages(new, i, PGSIZE, pa, flags) != 0 )
-        goto err;
-    
-    pageRef( ( void* )pa );
-    
-    uvmunmap(old, i, 1, 0);
+  return uvmshare(old, new, 0, sz, 1);
+}
 
-    if(mappages(old, i, PGSIZE, (uint64)pa, flags) != 0){
+// Map the pages of old in [start, end) into new as well.
+// If cow, writable parent PTEs are rewritten in place to be
+// copy-on-write; otherwise both stay writable and see each
+// other's stores. Each leaf page-table page is copied into
+// the child in one go; the caller flushes the parent's TLB
+// entries once at the end (see uvmflush).
+// start must be page-aligned.
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int cow)
+{
+  pte_t *l1;
+  pagetable_t l0, cl0;
+  uint64 va, next, i, last;
+
+  end = PGROUNDUP(end);
+  for(va = start; va < end; va = next){
+    next = SUPERPGROUNDDOWN(va) + SUPERPGSIZE;
+    if(next > end)
+      next = end;
+    // Ranges that were never touched stay lazy in the child too.
+    if((l1 = walkmega(old, va, 0)) == 0 || (*l1 & PTE_V) == 0)
+      continue;
+    // Megapages are shared page by page.
+    if(PTE_LEAF(*l1) && demote(l1) != 0)
+      goto err;
+    l0 = (pagetable_t)PTE2PA(*l1);
+    if((cl0 = walk(new, SUPERPGROUNDDOWN(va), 1)) == 0)
       goto err;
+
+    last = PX(0, va) + (next - va) / PGSIZE;
+    for(i = PX(0, va); i < last; i++){
+      // A paged-out page is shared through its swap slot.
+      if(l0[i] & PTE_SWAP){
+        swapdup(l0[i]);
+        cl0[i] = l0[i];
+        continue;
+      }
+      if((l0[i] & PTE_V) == 0)
+        continue;
+      if(cow && (l0[i] & PTE_W))
+        l0[i] = (l0[i] & ~PTE_W) | PTE_COW;
+      pageRef((void*)PTE2PA(l0[i]));
+      cl0[i] = l0[i];
     }
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (va - start) / PGSIZE, 1);
   return -1;
 }
 
-// mark a PTE invalid for user access.
-// used by exec for the user stack guard page.
+// Map the shared zero page at va with permissions perm,
+// copy-on-write instead of writable. cowfault() gives it
+// a page of its own when it is written. Without PTE_W in
+// perm it is neither, and copyout() won't write it either.
+// Returns 0 on success, -1 if out of memory.
+int
+mapzero(pagetable_t pagetable, uint64 va, int perm)
+{
+  if(perm & PTE_W)
+    perm = (perm & ~PTE_W) | PTE_COW;
+  if(mappages(pagetable, va, PGSIZE, zeropa, perm) != 0)
+    return -1;
+  pageRef((void*)zeropa);
+  return 0;
+}
+
+// Map a zeroed page at va if it lies below the process
+// size sz but was never touched since growproc() reserved
+// it: the shared zero page for a read, a new one for a
+// write. Returns 0 on success, -1 if va isn't such an
+// address or memory is exhausted.
+int
+lazyfault(pagetable_t pagetable, uint64 va, uint64 sz, int write)
+{
+  pte_t *pte;
+  char *mem;
+
+  if(va >= sz || va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V))
+    return -1;
+
+  if(!write)
+    return mapzero(pagetable, va, PTE_R|PTE_W|PTE_U);
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Back the whole 2 MiB aligned region around va with one
+// zeroed megapage, if p asked for superpages and none of
+// the region has been touched yet. Only heap qualifies:
+// the region must lie below p->sz and clear of the
+// program's segments. Returns 0 on success, -1 if not.
+static int
+megafault(struct proc *p, uint64 va)
+{
+  uint64 base = SUPERPGROUNDDOWN(va);
+  struct execseg *s;
+  pte_t *pte;
+  char *mem;
+
+  if(base + SUPERPGSIZE > p->sz)
+    return -1;
+  for(s = p->execseg; s < &p->execseg[p->nexecseg]; s++)
+    if(s->va < base + SUPERPGSIZE && base < s->va + s->memsz)
+      return -1;
+  if((pte = walkmega(p->pagetable, base, 1)) == 0 || (*pte & PTE_V))
+    return -1;
+  if((mem = kalloc_pages(SUPERPAGE_ORDER)) == 0)
+    return -1;
+  memset(mem, 0, SUPERPGSIZE);
+  *pte = PA2PTE(mem) | PTE_R | PTE_W | PTE_U | PTE_V;
+  return 0;
+}
+
+// Handle a page fault at user address va of process p:
+// read back a paged-out page, break COW sharing, read in
+// program or mapped file pages, or supply zeroed heap.
+// write is set for a store, which needs a page of its own,
+// and exec for an instruction fetch. cansleep is 0 if the caller holds a spinlock, in which
+// case the disk can't be read.
+// Returns 0 if the fault was resolved, -1 if not.
+int
+uvmfault(struct proc *p, uint64 va, int write, int exec, int cansleep)
+{
+  pte_t *pte;
+  int r, need;
+
+  need = write ? PTE_W : (exec ? PTE_X : PTE_R);
+
+  // Already mapped, but the TLB still held the invalid PTE,
+  // or the hardware wants the accessed and dirty bits set.
+  if(va < MAXVA && (pte = walk(p->pagetable, va, 0)) != 0 &&
+     (*pte & (PTE_V | PTE_U)) == (PTE_V | PTE_U) &&
+     (*pte & need)){
+    *pte |= PTE_A | (write ? PTE_D : 0);
+    uvmflushlocal(p, va);
+    return 0;
+  }
+
+  // Faults that change just the page at va.
+  if((r = swapin(p, va, cansleep)) != 1){
+    if(r == 0){
+      p->majflt++;
+      uvmflushlocal(p, va);
+    }
+    return r;
+  }
+  if(cowfault(p->pagetable, va) == 0){
+    p->minflt++;
+    p->cowflt++;
+    // va may have a new page, which no CPU may still see.
+    uvmflushpage(p, va);
+    return 0;
+  }
+  // The rest may map the pages around it too. Program
+  // and file pages are counted as read from the disk.
+  if((r = execfault(p, va, write, cansleep)) == 1 &&
+     (r = vmafault(p, va, cansleep)) == 1){
+    if(!p->superpages || (r = megafault(p, va)) != 0)
+      r = lazyfault(p->pagetable, va, p->sz, write);
+    if(r == 0)
+      p->minflt++;
+  } else if(r == 0){
+    p->majflt++;
+  }
+  if(r == 0){
+    // The stack grew; below it is the guard page.
+    if(va < p->ustacklow && va >= p->ustacktop - USTACKMAX*PGSIZE)
+      p->ustacklow = PGROUNDDOWN(va);
+    // Only invalid PTEs were filled in.
+    uvmflushlocal(p, va);
+  }
+  return r;
+}
+
+// Add up the user pages mapped by a page-table page at
+// level, for uvmusage().
+static void
+uvmcount(pagetable_t pagetable, int level, struct rusage *ru)
+{
+  uint64 n;
+  pte_t pte;
+
+  for(int i = 0; i < 512; i++){
+    pte = pagetable[i];
+    if(pte & PTE_SWAP){
+      ru->swapped++;
+    } else if((pte & PTE_V) && !PTE_LEAF(pte)){
+      uvmcount((pagetable_t)PTE2PA(pte), level - 1, ru);
+    } else if((pte & (PTE_V | PTE_U)) == (PTE_V | PTE_U)){
+      n = 1L << (9 * level);
+      ru->rss += n;
+      if(pageRefCount((void*)PTE2PA(pte)) > 1)
+        ru->shared += n;
+    }
+  }
+}
+
+// Fill in the memory use of p: what its page table maps,
+// its fault counts, and the system-wide page counts.
+// The page table is only walked here, so nothing needs
+// to be kept up to date as pages come and go.
+void
+uvmusage(struct proc *p, struct rusage *ru)
+{
+  uint64 nfree, ntotal;
+
+  memset(ru, 0, sizeof(*ru));
+  uvmcount(p->pagetable, 2, ru);
+  ru->minflt = p->minflt;
+  ru->majflt = p->majflt;
+  ru->cowflt = p->cowflt;
+  if(p->ustacktop)
+    ru->stack = p->ustacktop - p->ustacklow;
+  kmemcount(&nfree, &ntotal);
+  ru->memfree = nfree;
+  ru->memused = ntotal - nfree;
+}
+
+// Fault in the not yet present pages of [va, va+len) in
+// the current process, so that a later copyin()/copyout()
+// made while holding a spinlock finds them mapped, and
+// writable if write is set. They are not paged out again
+// until the system call returns.
+// Stops quietly at the first page that can't be brought in;
+// the copy will then fail as usual.
 void
-uvmclear(pagetable_t pagetable, uint64 va)
+uvmprefault(uint64 va, uint64 len, int write)
+{
+  struct proc *p = myproc();
+  uint64 a, last;
+  pte_t *pte;
+
+  if(len == 0 || va + len < va || va + len > MAXVA)
+    return;
+  p->pinned = 1;
+  last = PGROUNDDOWN(va + len - 1);
+  for(a = PGROUNDDOWN(va); a <= last; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte && (*pte & PTE_V) && !(write && (*pte & PTE_COW)))
+      continue;
+    if(uvmfault(p, a, write, 0, 1) < 0)
+      return;
+  }
+}
+
+// Return the PTE of user page va, faulting it in first if
+// it belongs to the current process but hasn't been
+// touched yet; write as for uvmfault().
+// Returns 0 if va is not user-accessible.
+static pte_t *
+walkuser(pagetable_t pagetable, uint64 va, int write, int *level)
 {
+  struct proc *p = myproc();
   pte_t *pte;
-  
+  int cansleep;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walklevel(pagetable, va, 0, level);
+  if((pte == 0 || (*pte & PTE_V) == 0) && p && p->pagetable == pagetable){
+    push_off();
+    cansleep = mycpu()->noff == 1;
+    pop_off();
+    if(uvmfault(p, va, write, 0, cansleep) < 0)
+      return 0;
+    pte = walklevel(pagetable, va, 0, level);
+  }
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+    return 0;
+  return pte;
+}
+
+// Resolve a write to the copy-on-write page at va.
+// If this page table holds the only reference to the
+// page, make it writable in place; otherwise give it
+// a private copy. Returns 0 on success, -1 if va is
+// not a COW page or memory is exhausted.
+int
+cowfault(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa, flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
   pte = walk(pagetable, va, 0);
   if(pte == 0)
-    panic("uvmclear");
-  *pte &= ~PTE_U;
+    return -1;
+  if((*pte & (PTE_V | PTE_U | PTE_COW)) != (PTE_V | PTE_U | PTE_COW))
+    return -1;
+
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+
+  // Sole owner: the other sharers have already
+  // broken away, so there is nothing to copy.
+  if(pageRefCount((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if(pa == zeropa){
+    if((mem = kalloc_zeroed()) == 0)
+      return -1;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, (void*)pa, PGSIZE);
+  }
+  // Instead of unmapping and remapping, the PTE is directly modified.
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
+// A cursor over the user pages touched by one copy. It
+// remembers the leaf page-table page of the last 2 MiB
+// region, so that consecutive pages are found by indexing
+// it instead of walking from the root.
+struct ucursor {
+  pagetable_t pagetable;
+  int write;          // copying out, so pages must be writable
+  pagetable_t leaf;   // level-0 page-table page, or 0
+  uint64 leafva;      // 2 MiB region it maps
+};
+
+// Return the PTE of user page va, as walkuser() does.
+static pte_t *
+upte(struct ucursor *c, uint64 va, int *level)
+{
+  pte_t *pte;
+
+  if(c->leaf && SUPERPGROUNDDOWN(va) == c->leafva){
+    pte = &c->leaf[PX(0, va)];
+    if((*pte & (PTE_V | PTE_U)) == (PTE_V | PTE_U)){
+      *level = 0;
+      return pte;
+    }
+  }
+  if((pte = walkuser(c->pagetable, va, c->write, level)) == 0)
+    return 0;
+  if(*level == 0){
+    c->leaf = pte - PX(0, va);
+    c->leafva = SUPERPGROUNDDOWN(va);
+  } else {
+    c->leaf = 0;
+  }
+  return pte;
+}
+
+// Copy n bytes between non-overlapping buffers, eight
+// at a time when both are equally aligned.
+static void
+copywords(char *dst, const char *src, uint64 n)
+{
+  if(((uint64)dst & 7) == ((uint64)src & 7)){
+    while(n > 0 && ((uint64)dst & 7)){
+      *dst++ = *src++;
+      n--;
+    }
+    for(; n >= 8; n -= 8, dst += 8, src += 8)
+      *(uint64*)dst = *(const uint64*)src;
+  }
+  while(n-- > 0)
+    *dst++ = *src++;
 }
 
 // Copy from kernel to user.
@@ -367,54 +905,38 @@ uvmclear(pagetable_t pagetable, uint64 va)
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
-  uint64 va0, pa0, n, flags;
+  struct ucursor c = { pagetable, 1, 0, 0 };
+  uint64 va0, pa0, n;
   pte_t *pte;
+  int level;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-
-    if ( pa0 == 0 )
-        return -1;
-    pte = walk(pagetable, va0, 0);
+    if((pte = upte(&c, va0, &level)) == 0)
+      return -1;
+    // Program pages are shared by everyone running the
+    // program, and must not be written.
+    if((*pte & (PTE_W | PTE_COW)) == 0)
+      return -1;
 
-    flags = PTE_FLAGS(*pte);
-    
-    if ( ( *pte & PTE_V )  == 0 )
-        return -1;
-    if ( ( *pte & PTE_U ) == 0 )
+    // This is where the code should end up in case of cow-fork.
+    // Only the current process has COW pages to copy out to.
+    if(*pte & PTE_COW){
+      if(cowfault(pagetable, va0) < 0)
         return -1;
-    
-    if ( PTE_COW & flags )    
-    {
-        if ( (PTE_V & *pte) && ( PTE_U & *pte) && ( PTE_COW & *pte) )
-        {
-            // This is where the code should end up in case of cow-fork.
-
-            flags |= PTE_W;
-            flags &= (~PTE_COW);
-
-            char *newMemory = kalloc();
-
-            if ( newMemory == 0 )
-            {
-                setkilled(myproc());
-            }
-
-            memmove( newMemory, (void*)pa0, PGSIZE);
-
-            *pte = PA2PTE(newMemory) | flags ;
-            // Instead of unmapping and remapping, the flag is directly modified.
-
-            kfree((void*)pa0);
-        }
-        pa0 = walkaddr(pagetable, va0);
+      myproc()->minflt++;
+      myproc()->cowflt++;
+      uvmflushpage(myproc(), va0);
     }
+    // Like a store from user space, so that munmap()
+    // writes the page back.
+    *pte |= PTE_D;
+    pa0 = leafpa(*pte, level, va0);
 
     n = PGSIZE - (dstva - va0);
     if(n > len)
         n = len;
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
+    copywords((char *)(pa0 + (dstva - va0)), src, n);
     
     len -= n;
     src += n;
@@ -429,17 +951,20 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
+  struct ucursor c = { pagetable, 0, 0, 0 };
   uint64 n, va0, pa0;
+  pte_t *pte;
+  int level;
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pte = upte(&c, va0, &level)) == 0)
       return -1;
+    pa0 = leafpa(*pte, level, va0);
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    copywords(dst, (char *)(pa0 + (srcva - va0)), n);
 
     len -= n;
     dst += n;
@@ -456,13 +981,15 @@ int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
   uint64 n, va0, pa0;
-  int got_null = 0;
+  struct ucursor c = { pagetable, 0, 0, 0 };
+  pte_t *pte;
+  int level, got_null = 0;
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pte = upte(&c, va0, &level)) == 0)
       return -1;
+    pa0 = leafpa(*pte, level, va0);
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
@@ -0,0 +1,85 @@
+//
+// throughput of the kernel's copyin()/copyout() paths:
+// bulk data through a pipe between two processes, and
+// repeated reads of a file that sits in the buffer cache.
+//
+
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define FILEBYTES (32 * 1024)
+#define FILEREADS 256
+
+char buf[8192];
+
+void
+pipebench(int chunk, int bytes)
+{
+  int p[2], n, total, t0, t1;
+
+  if(pipe(p) < 0){
+    printf("copybench: pipe failed\n");
+    exit(1);
+  }
+  t0 = uptime();
+  int pid = fork();
+  if(pid < 0){
+    printf("copybench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(p[0]);
+    for(total = 0; total < bytes; total += chunk)
+      if(write(p[1], buf, chunk) != chunk){
+        printf("copybench: pipe write failed\n");
+        exit(1);
+      }
+    exit(0);
+  }
+  close(p[1]);
+  for(total = 0; (n = read(p[0], buf, chunk)) > 0; total += n)
+    ;
+  close(p[0]);
+  wait(0);
+  t1 = uptime();
+  printf("pipe, %d byte writes: %d KiB in %d ticks\n", chunk, total / 1024, t1 - t0);
+}
+
+void
+filebench(void)
+{
+  int fd, i, n, total = 0, t0, t1;
+
+  unlink("copybench.tmp");
+  fd = open("copybench.tmp", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("copybench: create failed\n");
+    exit(1);
+  }
+  for(i = 0; i < FILEBYTES; i += sizeof(buf))
+    write(fd, buf, sizeof(buf));
+  close(fd);
+
+  t0 = uptime();
+  for(i = 0; i < FILEREADS; i++){
+    fd = open("copybench.tmp", O_RDONLY);
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+      total += n;
+    close(fd);
+  }
+  t1 = uptime();
+  unlink("copybench.tmp");
+  printf("file, %d byte reads: %d KiB in %d ticks\n", (int)sizeof(buf), total / 1024, t1 - t0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  memset(buf, 'x', sizeof(buf));
+  pipebench(1, 256 * 1024);
+  pipebench(512, 8 * 1024 * 1024);
+  pipebench(8192, 8 * 1024 * 1024);
+  filebench();
+  exit(0);
+}
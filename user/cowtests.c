@@ -4,6 +4,7 @@
 
 #include "kernel/types.h"
 #include "kernel/memlayout.h"
+#include "kernel/rusage.h"
 #include "user/user.h"
 
 // allocate more than half of physical memory,
@@ -177,6 +178,50 @@ filetest()
   printf("ok\n");
 }
 
+// getrusage() sees the pages fork() shares, and
+// counts the COW faults that break the sharing.
+void
+rusagetest()
+{
+  enum { N = 16 };
+  struct rusage r0, r1;
+  char *p;
+
+  printf("rusage: ");
+
+  p = sbrk(N * 4096);
+  for(int i = 0; i < N; i++)
+    p[i * 4096] = 1;
+
+  int pid = fork();
+  if(pid < 0){
+    printf("fork() failed\n");
+    exit(-1);
+  }
+  if(pid == 0){
+    if(getrusage(&r0) < 0)
+      exit(-1);
+    for(int i = 0; i < N; i++)
+      p[i * 4096] = 2;
+    if(getrusage(&r1) < 0)
+      exit(-1);
+    if(r0.shared < N || r1.cowflt - r0.cowflt < N || r1.shared > r0.shared - N)
+      exit(-1);
+    if(r1.rss < N || r1.memfree == 0 || r1.memused == 0)
+      exit(-1);
+    exit(0);
+  }
+
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("wrong counts\n");
+    exit(-1);
+  }
+  sbrk(-N * 4096);
+  printf("ok\n");
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -191,6 +236,8 @@ main(int argc, char *argv[])
 
   filetest();
 
+  rusagetest();
+
   printf("ALL COW TESTS PASSED\n");
 
   exit(0);
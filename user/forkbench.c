@@ -0,0 +1,46 @@
+//
+// fork latency as a function of process size: grow the
+// heap, touch every page, then time fork()+exit()+wait()
+// round trips. The child exits at once, so the cost is
+// almost all in sharing the parent's page tables.
+//
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NFORK 200
+
+int
+main(int argc, char *argv[])
+{
+  int sizes[] = { 0, 1, 4, 16, 64 };  // MiB of extra heap
+  int grown = 0;
+
+  for(int k = 0; k < sizeof(sizes)/sizeof(sizes[0]); k++){
+    int n = sizes[k] * 1024 * 1024 - grown;
+    char *p = sbrk(n);
+    if(p == (char*)-1){
+      printf("forkbench: sbrk(%d) failed\n", n);
+      exit(1);
+    }
+    for(char *q = p; q < p + n; q += PGSIZE)
+      *q = 1;
+    grown += n;
+
+    int t0 = uptime();
+    for(int i = 0; i < NFORK; i++){
+      int pid = fork();
+      if(pid < 0){
+        printf("forkbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        exit(0);
+      wait(0);
+    }
+    int t1 = uptime();
+    printf("%d MiB: %d forks in %d ticks\n", sizes[k], NFORK, t1 - t0);
+  }
+  exit(0);
+}
@@ -2,40 +2,214 @@
 #include "kernel/stat.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
+#include "kernel/param.h"
 
 #define NFORK 5
 
-int main()
-{
-    int pid;
 #ifdef LBS
-    pid = fork();
-    if (pid < 0)
+#define NLOTTERY 4
+#define LOTTICKS 100    // How long the children compete, about 10s
+
+// CPU-bound children with 10, 20, 30 and 40 tickets compete
+// for LOTTICKS ticks. Compare each one's share of the CPU
+// time with its share of the tickets, in tenths of a
+// percent, and sum the differences. Run with CPUS=1.
+void
+lottery(void)
+{
+    int pids[NLOTTERY], tickets[NLOTTERY], rtimes[NLOTTERY];
+    int pid, rtime, wtime, sumtickets = 0, sumrtime = 0, error = 0;
+    int deadline = uptime() + LOTTICKS;
+
+    for (int i = 0; i < NLOTTERY; i++)
+    {
+        tickets[i] = 10 * (i + 1);
+        sumtickets += tickets[i];
+        rtimes[i] = 0;
+        if ((pids[i] = fork()) < 0)
+        {
+            printf("schedulertest: fork failed\n");
+            exit(1);
+        }
+        if (pids[i] == 0)
+        {
+            settickets(tickets[i]);
+            while (uptime() < deadline)
+            {}
+            exit(0);
+        }
+    }
+    for (int n = 0; n < NLOTTERY; n++)
+    {
+        if ((pid = waitx(0, &rtime, &wtime, 0)) < 0)
+        {
+            break;
+        }
+        for (int i = 0; i < NLOTTERY; i++)
+        {
+            if (pids[i] == pid)
+            {
+                rtimes[i] = rtime;
+            }
+        }
+        sumrtime += rtime;
+    }
+    if (sumrtime == 0)
+    {
+        sumrtime = 1;
+    }
+    for (int i = 0; i < NLOTTERY; i++)
+    {
+        int want = 1000 * tickets[i] / sumtickets;
+        int got = 1000 * rtimes[i] / sumrtime;
+        printf("tickets %d: rtime %d, share %d/1000, expected %d/1000\n",
+               tickets[i], rtimes[i], got, want);
+        error += got > want ? got - want : want - got;
+    }
+    printf("Fairness error %d/1000\n", error);
+}
+#endif
+
+#define NHOG 4
+#define NIO 8
+#define MIXTICKS 50     // How long the children run, about 5s
+
+// Sort a[0..n-1] and print its median, 90th percentile
+// and maximum.
+void
+percentiles(char *what, int *a, int n)
+{
+    if (n == 0)
+    {
+        return;
+    }
+    for (int i = 1; i < n; i++)
+    {
+        for (int j = i; j > 0 && a[j - 1] > a[j]; j--)
+        {
+            int t = a[j];
+            a[j] = a[j - 1];
+            a[j - 1] = t;
+        }
+    }
+    printf("%s: p50 %d, p90 %d, max %d\n", what, a[n / 2], a[(n - 1) * 9 / 10], a[n - 1]);
+}
+
+// Print the median, 90th and 99th percentile of the waits
+// counted in a waitx() latency histogram.
+void
+latpercentiles(char *what, uint *hist)
+{
+    uint total = 0, sum = 0;
+    int q[] = { 50, 90, 99 }, k = 0;
+
+    for (int i = 0; i < NLATBUCKET; i++)
     {
-        exit(0);
+        total += hist[i];
+    }
+    printf("%s: %d waits", what, total);
+    for (int i = 0; i < NLATBUCKET && k < 3 && total > 0; i++)
+    {
+        sum += hist[i];
+        for (; k < 3 && sum * 100 >= total * q[k]; k++)
+        {
+            printf(", p%d < %dus", q[k], 1 << i);
+        }
     }
-    else if (pid == 0)
+    printf("\n");
+}
+
+// CPU hogs mixed with interactive children that sleep for
+// a tick at a time, for MIXTICKS ticks. waitx() returns
+// each child's run and wait times, and a histogram of how
+// long it waited for a cpu each time it became RUNNABLE.
+// Run with CPUS=1.
+void
+mixed(void)
+{
+    int hogs[NHOG], wtimes[NHOG + NIO];
+    int pid, rtime, wtime, nhog = 0, nio = 0, hogrtime = 0, iortime = 0;
+    uint hist[NLATBUCKET], hoglat[NLATBUCKET], iolat[NLATBUCKET];
+    int deadline = uptime() + MIXTICKS;
+
+    memset(hoglat, 0, sizeof(hoglat));
+    memset(iolat, 0, sizeof(iolat));
+    for (int i = 0; i < NHOG + NIO; i++)
     {
-        // Child
-        for (int i = 0; i < 1000 * 500000; i++)
+        if ((pid = fork()) < 0)
         {
-            if (i % 1000000 == 0)
+            printf("schedulertest: fork failed\n");
+            exit(1);
+        }
+        if (pid == 0 && i < NHOG)
+        {
+            while (uptime() < deadline)
+            {}
+            exit(0);
+        }
+        if (pid == 0)
+        {
+            while (uptime() < deadline)
             {
-                printf(".");
+                sleep(1);
+                for (volatile int j = 0; j < 10000; j++)
+                {}
             }
+            exit(0);
+        }
+        if (i < NHOG)
+        {
+            hogs[i] = pid;
         }
     }
-    else
+    for (int n = 0; n < NHOG + NIO; n++)
     {
-        // Parent
-        for (int i = 0; i < 1000 * 500000; i++)
+        if ((pid = waitx(0, &rtime, &wtime, hist)) < 0)
         {
-            if (i % 1000000 == 0)
+            break;
+        }
+        wtimes[n] = wtime;
+        int hog = 0;
+        for (int i = 0; i < NHOG; i++)
+        {
+            if (hogs[i] == pid)
+            {
+                hog = 1;
+            }
+        }
+        for (int i = 0; i < NLATBUCKET; i++)
+        {
+            if (hog)
+            {
+                hoglat[i] += hist[i];
+            }
+            else
             {
-                printf("#");
+                iolat[i] += hist[i];
             }
         }
+        if (hog)
+        {
+            hogrtime += rtime;
+            nhog++;
+        }
+        else
+        {
+            iortime += rtime;
+            nio++;
+        }
     }
+    printf("%d hogs ran %d ticks, %d interactive ran %d ticks\n", nhog, hogrtime, nio, iortime);
+    percentiles("wtime", wtimes, nhog + nio);
+    latpercentiles("hog latency", hoglat);
+    latpercentiles("interactive latency", iolat);
+}
+
+int main()
+{
+    int pid;
+#ifdef LBS
+    lottery();
     exit(0);
 #endif
 
@@ -60,17 +234,18 @@ int main()
         }
         else
         {
-            set_priority(80, pid); // Will only matter for PBS, set lower priority for IO bound processes 
+            set_priority(80, pid); // Will only matter for PBS and CFS, set lower priority for IO bound processes 
         }
     }
     for(; n > 0; n--)
     {
-        if(waitx(0,&rtime,&wtime) >= 0)
+        if(waitx(0,&rtime,&wtime,0) >= 0)
         {
             trtime += rtime;
             twtime += wtime;
         } 
     }
     printf("Average rtime %d,  wtime %d\n", trtime / NFORK, twtime / NFORK);
+    mixed();
     exit(0);
 }
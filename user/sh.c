@@ -3,6 +3,7 @@
 #include "kernel/types.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
+#include "kernel/spawn.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -52,8 +53,100 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
 void runcmd(struct cmd*) __attribute__((noreturn));
 
+// Apply spawn() actions by hand, in a forked child.
+void
+doacts(struct spawnact *acts, int n)
+{
+  for(int i = 0; i < n; i++){
+    switch(acts[i].op){
+    case SPAWN_CLOSE:
+      close(acts[i].fd);
+      break;
+    case SPAWN_DUP:
+      close(acts[i].fd);
+      dup(acts[i].src);
+      break;
+    case SPAWN_OPEN:
+      close(acts[i].fd);
+      if(open(acts[i].path, acts[i].omode) < 0){
+        fprintf(2, "open %s failed\n", acts[i].path);
+        exit(1);
+      }
+      break;
+    }
+  }
+}
+
+void
+setact(struct spawnact *act, int op, int fd, int src)
+{
+  act->op = op;
+  act->fd = fd;
+  act->src = src;
+}
+
+// Start cmd with the file actions acts[0..n-1] applied.
+// Commands, redirections and pipelines are started with
+// spawn(), so the shell's memory isn't copied for each;
+// anything else, or a spawn() that fails, runs in a
+// forked child as runcmd() would.
+// Returns the number of children to wait for.
+int
+spawncmd(struct cmd *cmd, struct spawnact *acts, int n)
+{
+  int p[2], k;
+  struct execcmd *ecmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  switch(cmd->type){
+  case EXEC:
+    ecmd = (struct execcmd*)cmd;
+    if(ecmd->argv[0] == 0)
+      break;
+    acts[n].op = 0;
+    if(spawn(ecmd->argv[0], ecmd->argv, acts) >= 0)
+      return 1;
+    break;
+
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    if(n + 1 >= NSPAWNACT)
+      break;
+    setact(&acts[n], SPAWN_OPEN, rcmd->fd, 0);
+    acts[n].omode = rcmd->mode;
+    acts[n].path = rcmd->file;
+    return spawncmd(rcmd->cmd, acts, n + 1);
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    if(n + 3 >= NSPAWNACT)
+      break;
+    if(pipe(p) < 0)
+      panic("pipe");
+    setact(&acts[n], SPAWN_DUP, 1, p[1]);
+    setact(&acts[n+1], SPAWN_CLOSE, p[0], 0);
+    setact(&acts[n+2], SPAWN_CLOSE, p[1], 0);
+    k = spawncmd(pcmd->left, acts, n + 3);
+    setact(&acts[n], SPAWN_DUP, 0, p[0]);
+    setact(&acts[n+1], SPAWN_CLOSE, p[0], 0);
+    setact(&acts[n+2], SPAWN_CLOSE, p[1], 0);
+    k += spawncmd(pcmd->right, acts, n + 3);
+    close(p[0]);
+    close(p[1]);
+    return k;
+  }
+
+  if(fork1() == 0){
+    doacts(acts, n);
+    runcmd(cmd);
+  }
+  return 1;
+}
+
 // Execute cmd.  Never returns.
 void
 runcmd(struct cmd *cmd)
@@ -149,7 +242,9 @@ int
 main(void)
 {
     static char buf[100];
-    int fd;
+    static struct spawnact acts[NSPAWNACT];
+    struct cmd *cmd;
+    int fd, n;
 
     // Ensure that three file descriptors are open.
     while((fd = open("console", O_RDWR)) >= 0)
@@ -176,12 +271,15 @@ main(void)
             }
             continue;
         }
-        if(fork1() == 0)
+        if((cmd = parsecmd(buf)) == 0)
+        {
+            continue;
+        }
+        for(n = spawncmd(cmd, acts, 0); n > 0; n--)
         {
-            // Child
-            runcmd(parsecmd(buf));
+            wait(0);
         }
-        wait(0);
+        freecmd(cmd);
     }
     exit(0);
 }
@@ -341,18 +439,36 @@ struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
 struct cmd *nulterminate(struct cmd*);
 
+// The shell parses commands itself, so a syntax error
+// must not exit it: report the first one and carry on.
+int parseerr;
+
+void
+syntax(char *s)
+{
+  if(!parseerr)
+    fprintf(2, "%s\n", s);
+  parseerr = 1;
+}
+
+// Returns 0 after reporting a syntax error.
 struct cmd*
 parsecmd(char *s)
 {
   char *es;
   struct cmd *cmd;
 
+  parseerr = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && !parseerr){
     fprintf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if(parseerr){
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -396,8 +512,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -422,8 +540,10 @@ parseblock(char **ps, char *es)
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -448,13 +568,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
+    if(argc >= MAXARGS - 1){
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -508,3 +632,40 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+void
+freecmd(struct cmd *cmd)
+{
+  struct backcmd *bcmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    freecmd(rcmd->cmd);
+    break;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+    break;
+
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    freecmd(lcmd->left);
+    freecmd(lcmd->right);
+    break;
+
+  case BACK:
+    bcmd = (struct backcmd*)cmd;
+    freecmd(bcmd->cmd);
+    break;
+  }
+  free(cmd);
+}
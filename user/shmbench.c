@@ -0,0 +1,125 @@
+//
+// a single-producer, single-consumer ring buffer in a
+// shared-memory segment, and its bandwidth compared with
+// a pipe for the same transfer between two processes.
+//
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define SHMKEY    0x5242   // "RB"
+#define RINGSIZE  (32 * PGSIZE)
+#define CHUNK     4096
+#define TOTAL     (16 * 1024 * 1024)
+
+// head and tail count bytes ever written and read; only
+// the producer moves head and only the consumer tail.
+struct ring {
+  volatile uint head;
+  volatile uint tail;
+  char data[RINGSIZE];
+};
+
+char buf[CHUNK];
+int ringid;
+
+struct ring*
+ringattach(void)
+{
+  struct ring *r;
+
+  if((ringid = shmget(SHMKEY, sizeof(struct ring))) < 0 ||
+     (r = shmat(ringid)) == (struct ring*)-1){
+    printf("shmbench: can't attach ring\n");
+    exit(1);
+  }
+  return r;
+}
+
+void
+ringput(struct ring *r, char *p, int n)
+{
+  uint h = r->head;
+
+  // Wait for room, then publish the bytes before head.
+  while(h - r->tail > RINGSIZE - n)
+    ;
+  for(int i = 0; i < n; i++)
+    r->data[(h + i) % RINGSIZE] = p[i];
+  __sync_synchronize();
+  r->head = h + n;
+}
+
+void
+ringget(struct ring *r, char *p, int n)
+{
+  uint t = r->tail;
+
+  while(r->head - t < n)
+    ;
+  __sync_synchronize();
+  for(int i = 0; i < n; i++)
+    p[i] = r->data[(t + i) % RINGSIZE];
+  __sync_synchronize();
+  r->tail = t + n;
+}
+
+void
+shmrun(void)
+{
+  struct ring *r;
+  int total, t0, t1;
+
+  r = ringattach();
+  t0 = uptime();
+  if(fork() == 0){
+    // An unrelated process would find it by key the same way.
+    struct ring *w = ringattach();
+    for(total = 0; total < TOTAL; total += CHUNK)
+      ringput(w, buf, CHUNK);
+    exit(0);
+  }
+  for(total = 0; total < TOTAL; total += CHUNK)
+    ringget(r, buf, CHUNK);
+  wait(0);
+  t1 = uptime();
+  shmdt(r);
+  // Start from an empty ring next time.
+  shmrm(ringid);
+  printf("shm ring: %d KiB in %d ticks\n", TOTAL / 1024, t1 - t0);
+}
+
+void
+piperun(void)
+{
+  int p[2], n, total, t0, t1;
+
+  if(pipe(p) < 0){
+    printf("shmbench: pipe failed\n");
+    exit(1);
+  }
+  t0 = uptime();
+  if(fork() == 0){
+    close(p[0]);
+    for(total = 0; total < TOTAL; total += CHUNK)
+      write(p[1], buf, CHUNK);
+    exit(0);
+  }
+  close(p[1]);
+  for(total = 0; (n = read(p[0], buf, CHUNK)) > 0; total += n)
+    ;
+  close(p[0]);
+  wait(0);
+  t1 = uptime();
+  printf("pipe:     %d KiB in %d ticks\n", total / 1024, t1 - t0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  memset(buf, 'x', sizeof(buf));
+  piperun();
+  shmrun();
+  exit(0);
+}
@@ -0,0 +1,65 @@
+//
+// compare 4 KiB pages with 2 MiB megapages (superpages())
+// for a large heap: time to fault it in, and time to sweep
+// it one word per page, which is dominated by TLB misses
+// and page-table walks when every page has its own PTE.
+//
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define HEAPSZ (32 * 1024 * 1024)
+#define ROUNDS 400
+
+void
+run(int super)
+{
+  char *p, *q;
+  uint64 brk, pad;
+  int t0, t1, t2, r;
+  volatile int sum = 0;
+
+  superpages(super);
+
+  // megapages need a 2 MiB aligned heap.
+  brk = (uint64)sbrk(0);
+  pad = SUPERPGSIZE - brk % SUPERPGSIZE;
+  if(sbrk(pad) == (char*)-1 || (p = sbrk(HEAPSZ)) == (char*)-1){
+    printf("superbench: sbrk failed\n");
+    exit(1);
+  }
+
+  t0 = uptime();
+  for(q = p; q < p + HEAPSZ; q += PGSIZE)
+    *q = 1;
+  t1 = uptime();
+  for(r = 0; r < ROUNDS; r++)
+    for(q = p; q < p + HEAPSZ; q += PGSIZE)
+      sum += *q;
+  t2 = uptime();
+
+  printf("%s: fault-in %d ticks, %d sweeps of %d pages %d ticks\n",
+         super ? "2M pages" : "4K pages", t1 - t0, ROUNDS, HEAPSZ / PGSIZE, t2 - t1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int super;
+
+  // one child each, so both start from a fresh heap.
+  for(super = 0; super < 2; super++){
+    int pid = fork();
+    if(pid < 0){
+      printf("superbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      run(super);
+      exit(0);
+    }
+    wait(0);
+  }
+  exit(0);
+}
@@ -0,0 +1,66 @@
+//
+// context switches per second as the number of busy
+// processes grows: each pair of processes bounces a byte
+// back and forth through two pipes, so every round trip
+// is two sleeps and two wakeups. Run with different
+// CPUS= to see how the scheduler scales.
+//
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define NROUND 2000
+#define MAXPAIRS 8
+
+// Fork a pair that does NROUND round trips.
+void
+pair(void)
+{
+  int ping[2], pong[2];
+  char c = 0;
+
+  if(pipe(ping) < 0 || pipe(pong) < 0){
+    printf("swtchbench: pipe failed\n");
+    exit(1);
+  }
+  if(fork() == 0){
+    for(int i = 0; i < NROUND; i++){
+      read(ping[0], &c, 1);
+      write(pong[1], &c, 1);
+    }
+    exit(0);
+  }
+  for(int i = 0; i < NROUND; i++){
+    write(ping[1], &c, 1);
+    read(pong[0], &c, 1);
+  }
+  wait(0);
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  for(int n = 1; n <= MAXPAIRS; n *= 2){
+    int t0 = uptime();
+    for(int i = 0; i < n; i++){
+      int pid = fork();
+      if(pid < 0){
+        printf("swtchbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        pair();
+    }
+    for(int i = 0; i < n; i++)
+      wait(0);
+    int t1 = uptime();
+
+    // A tick is about 1/10th of a second.
+    int nswtch = 2 * NROUND * n;
+    int dt = t1 - t0 > 0 ? t1 - t0 : 1;
+    printf("%d pairs: %d switches in %d ticks, %d/s\n",
+           n, nswtch, t1 - t0, nswtch * 10 / dt);
+  }
+  exit(0);
+}
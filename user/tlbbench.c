@@ -0,0 +1,79 @@
+//
+// cost of system calls and context switches for a process
+// with a working set of pages: each round makes a system
+// call, or bounces a byte off another process through two
+// pipes, and then touches every page of the working set,
+// which misses in the TLB if the kernel flushed it.
+//
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NPAGES  32
+#define NCALLS  20000
+#define NSWITCH 2000
+
+char ws[NPAGES * PGSIZE];
+
+int
+touch(void)
+{
+  int sum = 0;
+
+  for(int i = 0; i < NPAGES; i++)
+    sum += ws[i * PGSIZE]++;
+  return sum;
+}
+
+void
+callbench(void)
+{
+  int t0, t1;
+
+  t0 = uptime();
+  for(int i = 0; i < NCALLS; i++){
+    getpid();
+    touch();
+  }
+  t1 = uptime();
+  printf("syscall + %d pages: %d rounds in %d ticks\n", NPAGES, NCALLS, t1 - t0);
+}
+
+void
+switchbench(void)
+{
+  int ping[2], pong[2], t0, t1;
+  char c = 0;
+
+  if(pipe(ping) < 0 || pipe(pong) < 0){
+    printf("tlbbench: pipe failed\n");
+    exit(1);
+  }
+  t0 = uptime();
+  if(fork() == 0){
+    for(int i = 0; i < NSWITCH; i++){
+      read(ping[0], &c, 1);
+      touch();
+      write(pong[1], &c, 1);
+    }
+    exit(0);
+  }
+  for(int i = 0; i < NSWITCH; i++){
+    write(ping[1], &c, 1);
+    read(pong[0], &c, 1);
+    touch();
+  }
+  wait(0);
+  t1 = uptime();
+  printf("switch + %d pages: %d round trips in %d ticks\n", NPAGES, NSWITCH, t1 - t0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  touch();
+  callbench();
+  switchbench();
+  exit(0);
+}
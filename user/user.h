@@ -4,12 +4,14 @@
 #include "kernel/types.h"
 
 struct stat;
+struct spawnact;
+struct rusage;
 
 // system calls
 int fork(void);
 int exit(int) __attribute__((noreturn));
 int wait(int*);
-int waitx(int*, int*, int*);
+int waitx(int*, int*, int*, uint*);
 int pipe(int*);
 int write(int, const void*, int);
 int read(int, void*, int);
@@ -33,6 +35,15 @@ int sigalarm(int, const void(*));
 int sigreturn(void);
 int set_priority(int, int);
 int settickets(int);
+int superpages(int);
+int spawn(const char*, char**, struct spawnact*);
+void* mmap(void*, uint64, int, int, int, int);
+int munmap(void*, uint64);
+int shmget(int, uint64);
+void* shmat(int);
+int shmdt(void*);
+int shmrm(int);
+int getrusage(struct rusage*);
 // ulib.c
 int stat(const char*, struct stat*);
 char* strcpy(char*, const char*);
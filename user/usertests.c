@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/spawn.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -113,6 +114,28 @@ copyout(char *s)
   }
 }
 
+// program pages are shared by every process running the
+// program, so system calls must not write them.
+void
+copyouttext(char *s)
+{
+  char *text = (char*)copyouttext;
+  char saved[8];
+
+  memmove(saved, text, sizeof(saved));
+  int fd = open("README.md", 0);
+  if(fd < 0){
+    printf("%s: open(README.md) failed\n", s);
+    exit(1);
+  }
+  int n = read(fd, text, sizeof(saved));
+  close(fd);
+  if(n > 0 || memcmp(saved, text, sizeof(saved)) != 0){
+    printf("%s: read() into program text returned %d\n", s, n);
+    exit(1);
+  }
+}
+
 // what if you pass ridiculous string pointers to system calls?
 void
 copyinstr1(char *s)
@@ -730,6 +753,286 @@ exectest(char *s)
 
 }
 
+// spawn() echo with its output redirected into a file
+// and into a pipe, and a missing program.
+void
+spawntest(char *s)
+{
+  int fd, pid, xstatus, p[2], i, n;
+  char *echoargv[] = { "echo", "OK", 0 };
+  struct spawnact acts[4];
+  char buf[3];
+
+  unlink("spawn-ok");
+  memset(acts, 0, sizeof(acts));
+  acts[0].op = SPAWN_OPEN;
+  acts[0].fd = 1;
+  acts[0].omode = O_CREATE|O_WRONLY;
+  acts[0].path = "spawn-ok";
+  if((pid = spawn("echo", echoargv, acts)) < 0){
+    printf("%s: spawn echo failed\n", s);
+    exit(1);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+  fd = open("spawn-ok", O_RDONLY);
+  if(fd < 0 || read(fd, buf, 2) != 2 || buf[0] != 'O' || buf[1] != 'K'){
+    printf("%s: wrong output in file\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("spawn-ok");
+
+  if(pipe(p) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  memset(acts, 0, sizeof(acts));
+  acts[0].op = SPAWN_DUP;
+  acts[0].fd = 1;
+  acts[0].src = p[1];
+  acts[1].op = SPAWN_CLOSE;
+  acts[1].fd = p[0];
+  acts[2].op = SPAWN_CLOSE;
+  acts[2].fd = p[1];
+  if((pid = spawn("echo", echoargv, acts)) < 0){
+    printf("%s: spawn echo failed\n", s);
+    exit(1);
+  }
+  close(p[1]);
+  // echo writes "OK" and "\n" separately.
+  for(i = 0; i < 3 && (n = read(p[0], buf + i, 3 - i)) > 0; i += n)
+    ;
+  if(i != 3 || buf[0] != 'O' || buf[1] != 'K' || buf[2] != '\n'){
+    printf("%s: wrong output in pipe\n", s);
+    exit(1);
+  }
+  close(p[0]);
+  wait(0);
+
+  if(spawn("nosuchprogram", echoargv, 0) >= 0){
+    printf("%s: spawn of missing program succeeded\n", s);
+    exit(1);
+  }
+}
+
+// map a file privately and shared, and check what reaches
+// the file, including stores made by a forked child. Two
+// shared mappings of a file, and read(), see each other's
+// stores before anything is written back.
+void
+mmaptest(char *s)
+{
+  int fd, fd2, i, pid, xstatus;
+  char *p, *q, c;
+  char b[6144];
+
+  unlink("mmap.tmp");
+  fd = open("mmap.tmp", O_CREATE|O_RDWR);
+  for(i = 0; i < sizeof(b); i++)
+    b[i] = 'A' + i / PGSIZE;
+  if(fd < 0 || write(fd, b, sizeof(b)) != sizeof(b)){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 'A' || p[PGSIZE] != 'B' || p[sizeof(b)-1] != 'B' || p[sizeof(b)] != 0){
+    printf("%s: wrong private contents\n", s);
+    exit(1);
+  }
+  p[0] = 'X';
+  if(munmap(p, 2*PGSIZE) < 0){
+    printf("%s: munmap private failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, sizeof(b), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  p[1] = 'Y';
+  q = mmap(0, sizeof(b), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(q == (char*)-1){
+    printf("%s: second mmap shared failed\n", s);
+    exit(1);
+  }
+  q[2] = 'W';
+  if(q[1] != 'Y' || p[2] != 'W'){
+    printf("%s: shared mappings differ\n", s);
+    exit(1);
+  }
+  if(munmap(q, sizeof(b)) < 0){
+    printf("%s: munmap second shared failed\n", s);
+    exit(1);
+  }
+  p[3] = 'V';
+  fd2 = open("mmap.tmp", O_RDONLY);
+  if(fd2 < 0 || read(fd2, &c, 1) != 1 || read(fd2, &c, 1) != 1 || c != 'Y' ||
+     read(fd2, &c, 1) != 1 || c != 'W' || read(fd2, &c, 1) != 1 || c != 'V'){
+    printf("%s: read() doesn't see the shared mapping\n", s);
+    exit(1);
+  }
+  close(fd2);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(p[1] != 'Y')
+      exit(1);
+    p[PGSIZE] = 'Z';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[PGSIZE] != 'Z'){
+    printf("%s: child didn't share the mapping\n", s);
+    exit(1);
+  }
+  if(munmap(p, sizeof(b)) < 0){
+    printf("%s: munmap shared failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmap.tmp", O_RDONLY);
+  if(fd < 0 || read(fd, b, sizeof(b)) != sizeof(b)){
+    printf("%s: reread failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmap.tmp");
+  if(b[0] != 'A' || b[1] != 'Y' || b[2] != 'W' || b[3] != 'V' || b[PGSIZE] != 'Z'){
+    printf("%s: wrong file contents after munmap\n", s);
+    exit(1);
+  }
+}
+
+// a shared-memory segment stays shared across fork(), and
+// a second attachment by key sees the same pages.
+void
+shmtest(char *s)
+{
+  int id, xstatus;
+  char *p, *q;
+
+  if((id = shmget(0x7e57, 2*PGSIZE)) < 0 || (p = shmat(id)) == (char*)-1){
+    printf("%s: shmget/shmat failed\n", s);
+    exit(1);
+  }
+  p[0] = 'a';
+  if(fork() == 0){
+    if((q = shmat(shmget(0x7e57, PGSIZE))) == (char*)-1 || q == p || q[0] != 'a')
+      exit(1);
+    q[PGSIZE] = 'b';
+    p[1] = 'c';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[PGSIZE] != 'b' || p[1] != 'c'){
+    printf("%s: segment not shared\n", s);
+    exit(1);
+  }
+  if(shmdt(p) < 0 || shmdt(p) == 0){
+    printf("%s: shmdt failed\n", s);
+    exit(1);
+  }
+
+  // a detached segment lasts until it is removed, and its
+  // id then names nothing, even once the slot is reused.
+  if((p = shmat(id)) == (char*)-1 || p[1] != 'c'){
+    printf("%s: segment lost when detached\n", s);
+    exit(1);
+  }
+  if(shmrm(id) < 0 || shmrm(id) == 0 || shmget(0x7e57, PGSIZE) == id){
+    printf("%s: shmrm failed\n", s);
+    exit(1);
+  }
+  if(p[1] != 'c' || shmdt(p) < 0 || shmat(id) != (char*)-1){
+    printf("%s: removed segment still attachable\n", s);
+    exit(1);
+  }
+  shmrm(shmget(0x7e57, PGSIZE));
+}
+
+// bss and heap read as zeroes before they are written, and
+// writes to them stay private to each process.
+char zerobss[16*PGSIZE];
+
+void
+zeropagetest(char *s)
+{
+  char *heap;
+  int i, pid, xstatus;
+
+  if((heap = sbrk(16*PGSIZE)) == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 16*PGSIZE; i += 512){
+    if(zerobss[i] != 0 || heap[i] != 0){
+      printf("%s: untouched memory not zero\n", s);
+      exit(1);
+    }
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    zerobss[PGSIZE] = 'c';
+    heap[PGSIZE] = 'c';
+    exit(zerobss[2*PGSIZE] != 0 || heap[2*PGSIZE] != 0);
+  }
+  zerobss[2*PGSIZE] = 'p';
+  heap[2*PGSIZE] = 'p';
+  wait(&xstatus);
+  if(xstatus != 0 || zerobss[PGSIZE] != 0 || heap[PGSIZE] != 0 ||
+     zerobss[2*PGSIZE] != 'p' || heap[2*PGSIZE] != 'p' || zerobss[3*PGSIZE] != 0){
+    printf("%s: zero pages shared after a write\n", s);
+    exit(1);
+  }
+}
+
+// a pipe write() whose buffer runs off the end of memory
+// writes and counts the bytes before the bad page.
+void
+pipeshort(char *s)
+{
+  int fds[2], n;
+  char buf[200];
+  uint64 top = (uint64) sbrk(0);
+
+  if((top % PGSIZE) != 0)
+    sbrk(PGSIZE - (top % PGSIZE));
+  top = (uint64) sbrk(0);
+  memset((char*)(top - 100), 'p', 100);
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  n = write(fds[1], (char*)(top - 100), 200);
+  if(n != 100){
+    printf("%s: write() past the end returned %d, not 100\n", s, n);
+    exit(1);
+  }
+  close(fds[1]);
+  if(read(fds[0], buf, sizeof(buf)) != 100 || buf[0] != 'p' || buf[99] != 'p'){
+    printf("%s: wrong bytes in the pipe\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+}
+
 // simple fork and pipe read/write
 
 void
@@ -2229,11 +2532,13 @@ sbrkfail(char *s)
   if(pid == 0){
     // allocate a lot of memory.
     // this should produce a page fault,
-    // and thus not complete.
+    // and thus not complete. Untouched heap reads as the
+    // shared zero page, so the pages must be written.
     a = sbrk(0);
     sbrk(10*BIG);
     int n = 0;
     for (i = 0; i < 10*BIG; i += PGSIZE) {
+      *(a+i) = 1;
       n += *(a+i);
     }
     // print n so the compiler doesn't optimize away
@@ -2418,8 +2723,8 @@ stacktest(char *s)
   pid = fork();
   if(pid == 0) {
     char *sp = (char *) r_sp();
-    sp -= PGSIZE;
-    // the *sp should cause a trap.
+    sp -= USTACKMAX*PGSIZE;
+    // below all the stack there may be, *sp should cause a trap.
     printf("%s: stacktest: read below stack %p\n", s, *sp);
     exit(1);
   } else if(pid < 0){
@@ -2433,6 +2738,41 @@ stacktest(char *s)
     exit(xstatus);
 }
 
+// the stack grows down past its first page, as deep as
+// USTACKMAX pages, when it is used.
+int
+stackdepth(int n)
+{
+  volatile char frame[1024];
+
+  frame[0] = n;
+  if(n == 0)
+    return 0;
+  return stackdepth(n - 1) + frame[0] - n + 1;
+}
+
+void
+stackgrow(char *s)
+{
+  int pid, xstatus;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // Leave a few pages for the rest of the frames.
+    int n = (USTACKMAX - 8) * PGSIZE / 1024;
+    exit(stackdepth(n) != n);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: deep recursion failed\n", s);
+    exit(1);
+  }
+}
+
 // check that writes to text segment fault
 void
 textwrite(char *s)
@@ -2566,6 +2906,54 @@ sbrk8000(char *s)
   *(top-1) = *(top-1) + 1;
 }
 
+// sbrk() only reserves address space; pages should be
+// allocated on first touch, by user code or by the kernel.
+void
+sbrklazy(char *s)
+{
+  enum { BIG=1024*1024*1024 };
+  char *a, *p;
+  int fd, pid, xstatus;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: lazy sbrk(%d) failed\n", s, BIG);
+    exit(1);
+  }
+
+  // touch a handful of far-apart pages.
+  for(p = a; p < a + BIG; p += BIG/8)
+    *p = 1;
+
+  // the kernel writes into a page user code never touched.
+  p = a + BIG/2 + 4096;
+  fd = open("README.md", O_RDONLY);
+  if(fd < 0 || read(fd, p, 10) != 10){
+    printf("%s: read into lazy page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // an untouched page reads as zero in a forked child.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(a[BIG - 1] == 0 && a[0] == 1 ? 0 : 1);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong lazy page contents\n", s);
+    exit(1);
+  }
+
+  if(sbrk(-BIG) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(-%d) failed\n", s, BIG);
+    exit(1);
+  }
+}
+
 
 
 // regression test. test whether exec() leaks memory if one of the
@@ -2589,6 +2977,7 @@ struct test {
 } quicktests[] = {
   {copyin, "copyin"},
   {copyout, "copyout"},
+  {copyouttext, "copyouttext"},
   {copyinstr1, "copyinstr1"},
   {copyinstr2, "copyinstr2"},
   {copyinstr3, "copyinstr3"},
@@ -2605,7 +2994,12 @@ struct test {
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
+  {spawntest, "spawntest"},
+  {mmaptest, "mmaptest"},
+  {shmtest, "shmtest"},
+  {zeropagetest, "zeropagetest"},
   {pipe1, "pipe1"},
+  {pipeshort, "pipeshort"},
   {killstatus, "killstatus"},
   {preempt, "preempt"},
   {exitwait, "exitwait"},
@@ -2641,11 +3035,13 @@ struct test {
   {bigargtest, "bigargtest"},
   {argptest, "argptest"},
   {stacktest, "stacktest"},
+  {stackgrow, "stackgrow"},
   {textwrite, "textwrite"},
   {pgbug, "pgbug" },
   {sbrkbugs, "sbrkbugs" },
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
+  {sbrklazy, "sbrklazy"},
   {badarg, "badarg" },
 
   { 0, 0},
@@ -2936,6 +3332,42 @@ outofinodes(char *s)
   }
 }
 
+// touch more memory than the machine has, so that some of
+// it must be paged out, and check that it all reads back.
+void
+swaptest(char *s)
+{
+  uint64 n = PHYSTOP - KERNBASE;
+  char *p, *a;
+  int pid, xstatus;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if((p = sbrk(n)) == (char*)-1){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    for(a = p; a < p + n; a += PGSIZE)
+      *(uint64*)a = (uint64)a;
+    for(a = p; a < p + n; a += PGSIZE){
+      if(*(uint64*)a != (uint64)a){
+        printf("%s: page at %p came back wrong\n", s, a);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child failed\n", s);
+    exit(1);
+  }
+}
+
 struct test slowtests[] = {
   {bigdir, "bigdir"},
   {manywrites, "manywrites"},
@@ -2943,6 +3375,7 @@ struct test slowtests[] = {
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
+  {swaptest, "swaptest"},
     
   { 0, 0},
 };
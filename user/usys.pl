@@ -42,3 +42,12 @@ entry("sigalarm");
 entry("sigreturn");
 entry("set_priority");
 entry("settickets");
+entry("superpages");
+entry("spawn");
+entry("mmap");
+entry("munmap");
+entry("shmget");
+entry("shmat");
+entry("shmdt");
+entry("getrusage");
+entry("shmrm");